@@ -82,10 +82,14 @@ typedef int IfStmt;
 typedef int ForStmt;
 typedef int WhileStmt;
 typedef int Stmt;
+typedef int Instr;
 
 /**
  * \enum{TokenKind}: Token kinds (lexical syntax)
  *
+ * \enum{CharClass}: Character classes used by the lexer to decide how to
+ * continue lexing from a given byte.
+ *
  * \enum{ConstStrKind}: Constant strings that get interned at startup as an
  * optimization
  *
@@ -147,6 +151,23 @@ enum TokenKind {
         TOKTYPE_BANG,
         TOKTYPE_ASSIGNEQUALS,
         TOKTYPE_DOUBLEEQUALS,
+        /* keywords */
+        TOKTYPE_IF,
+        TOKTYPE_WHILE,
+        TOKTYPE_FOR,
+        TOKTYPE_RETURN,
+        TOKTYPE_PROC,
+        TOKTYPE_DATA,
+        TOKTYPE_ENTITY,
+        TOKTYPE_ARRAY,
+};
+
+enum CharClass {
+        CHARCLASS_INVALID,
+        CHARCLASS_WHITESPACE,
+        CHARCLASS_ALPHA,
+        CHARCLASS_DIGIT,
+        CHARCLASS_OTHER,
 };
 
 enum ConstStrKind {
@@ -230,6 +251,51 @@ enum TypeKind {
         TYPE_REFERENCE,
 };
 
+/* Bytecode operations (see interp.c). r[] are the registers of the running
+ * proc. Jump targets are Instr indices. */
+enum OpKind {
+        OP_LITERAL,  // r[a] = integerLiteral[b]
+        OP_IMM,  // r[a] = b
+        OP_MOVE,  // r[a] = r[b]
+        OP_LOADG,  // r[a] = global data b
+        OP_STOREG,  // global data a = r[b]
+        OP_LOADA,  // r[a] = array b at index r[c]
+        OP_STOREA,  // array a at index r[b] = r[c]
+        OP_ADD,  // r[a] = r[b] + r[c], and so on
+        OP_SUB,
+        OP_MUL,
+        OP_DIV,
+        OP_AND,
+        OP_OR,
+        OP_XOR,
+        OP_EQ,
+        OP_NEG,  // r[a] = -r[b], and so on
+        OP_NOT,
+        OP_INV,
+        OP_INC,
+        OP_DEC,
+        OP_JUMP,  // goto a
+        OP_JUMPZ,  // if (!r[b]) goto a
+        OP_CALL,  // r[a] = proc b called with args r[c], r[c+1], ...
+        OP_RETURN,  // return r[a]
+        OP_TRAP,  // fail with trap message a at expression b
+        NUM_OPS,
+};
+
+/* Arrays hold elements at the indices 0 to MAX_ARRAY_LENGTH - 1. Their
+ * storage in bytes must fit in an int. */
+#define MAX_ARRAY_LENGTH (1 << 27)
+#define MAX_CALL_DEPTH (1 << 20)  // procs running at the same time
+
+/* Errors of the checks that both bytecode backends do at runtime. The
+ * argument of runtime_error() is the offending value, if any. */
+enum RuntimeError {
+        RUNTIME_DIVISION_BY_ZERO,
+        RUNTIME_NEGATIVE_INDEX,
+        RUNTIME_INDEX_OUT_OF_RANGE,
+        RUNTIME_STACK_OVERFLOW,
+};
+
 
 /**
  * \struct{StringToBeInterned} Static information used at program initialization
@@ -238,6 +304,11 @@ enum TypeKind {
  * \struct{BasetypeToBeInitialized}: Static information used at program
  * initialization time when base types get registered.
  *
+ * \struct{PunctuationInfo}: Static information used by the lexer for mapping
+ * the first character of a punctuation token to its token kind. If the next
+ * character is secondChar, the two characters form a token of kind
+ * doubleKind instead.
+ *
  * \struct{ToktypeToPrefixUnop}: Static information used for mapping tokens to
  * prefix operators (if possible).
  *
@@ -276,6 +347,19 @@ enum TypeKind {
  * \struct{ProcInfo}: Result from parsing a `proc` declaration.
  */
 
+/* Keywords are recognized by the lexer without interning them. keywordInfo is
+ * a perfect hash table: each keyword sits at the slot given by KEYWORD_HASH()
+ * of its first and last character. Unused slots have length 0. Two keywords
+ * hashing to the same slot show up as an overridden initializer in data.c
+ * (-Woverride-init, part of -Wextra). */
+#define KEYWORD_HASH(first, last) (((first) + (last)) & 15)
+
+struct KeywordInfo {
+        const char *string;
+        int length;
+        int kind;  // TOKTYPE_
+};
+
 struct StringToBeInterned {
         int constant;  // CONSTSTR_
         const char *string;
@@ -286,6 +370,13 @@ struct BasetypeToBeInitialized {
         int size;
 };
 
+struct PunctuationInfo {
+        unsigned char isValid;
+        unsigned char kind;  // TOKTYPE_
+        unsigned char secondChar;  // 0 if there is no two-character token
+        unsigned char doubleKind;  // TOKTYPE_
+};
+
 struct ToktypeToPrefixUnop {
         int ttype;
         int optype;
@@ -311,8 +402,13 @@ struct BinopInfo {
         char *str;
 };
 
+/* Allocation state of a buffer managed with the BUF_* macros. Buffers set up
+ * with BUF_INIT_ARENA() reserve a large range of address space on first use,
+ * and growing them only makes more pages of that range accessible. Unlike
+ * heap buffers, their elements never move. */
 struct Alloc {
-        int cap;
+        int cap;  // number of elements that fit without growing
+        int isArena;
 };
 
 struct FileInfo {
@@ -320,38 +416,73 @@ struct FileInfo {
         int size;
         unsigned char *buf;
         struct Alloc bufAlloc;
+        int isMapped;  // buf is a read-only file mapping, not from BUF_RESERVE
+        Token firstToken;  // the file's tokens, after lex_file()
+        int numTokens;
+        /* Offsets where lines begin. Built lazily by index_lines(). */
+        int lineCnt;
+        int *lineStart;
+        struct Alloc lineStartAlloc;
 };
 
 struct StringInfo {
         int pos;  // offset in character buffer
-        String next;  // next string in chain
 };
 
+/* Slot in the open-addressing string hash table. Hash, length and buffer
+ * position are stored inline, so a probe touches only the slot itself and,
+ * on a likely match, the string's characters. */
 struct StringBucketInfo {
-        String firstString;
-};
-
-struct WordTokenInfo {
-        String string;
+        unsigned hash;
+        int length;
+        int pos;  // offset in character buffer
+        String string;  // -1 if the slot is empty
 };
 
-struct IntegerTokenInfo {
-        long long value;
+/* Thread-private string table. Worker threads intern into their own arena
+ * without any synchronization, getting arena-local String indices. Later,
+ * merge_string_arena() maps these to global Strings. */
+struct StringArena {
+        char *strbuf;
+        struct StringBucketInfo *strings;  // indexed by arena-local String
+        struct StringBucketInfo *bucketInfo;
+        int strbufCnt;
+        int stringCnt;
+        int bucketCnt;
+        struct Alloc strbufAlloc;
+        struct Alloc stringsAlloc;
+        struct Alloc bucketInfoAlloc;
 };
 
-struct StringTokenInfo {
-        String value;
+/* Tokens are stored in columns, because the parser mostly looks only at the
+ * kind of a token: tokenKind (1 byte), tokenValue (4 bytes) and tokenLocation
+ * (8 bytes, mostly needed for messages). */
+union TokenValue {
+        String string;  // TOKTYPE_WORD
+        int literal;  // TOKTYPE_INTEGER: index into integerLiteral
 };
 
-struct TokenInfo {
+struct TokenLocation {
         File file;
         int offset;
-        int kind;
-        union {
-                struct WordTokenInfo tWord;
-                struct IntegerTokenInfo tInteger;
-                struct StringTokenInfo tString;
-        };
+};
+
+/* The result of lexing one file, possibly on a worker thread. Word tokens
+ * refer to Strings of the private arena, and integer tokens to the private
+ * literal array, until merge_file_tokens() appends the tokens to the global
+ * tables. */
+struct FileTokens {
+        unsigned char *kind;
+        union TokenValue *value;
+        int *offset;
+        long long *literal;
+        int tokenCnt;
+        int literalCnt;
+        struct Alloc kindAlloc;
+        struct Alloc valueAlloc;
+        struct Alloc offsetAlloc;
+        struct Alloc literalAlloc;
+        struct StringArena strings;
 };
 
 struct SymbolInfo {
@@ -435,6 +566,14 @@ struct ArrayInfo {
         Symbol sym;  // back-link
 };
 
+/* Slot in the open-addressing symbol table, which maps (scope, name) pairs to
+ * Symbols. Like in the string table, the key is stored inline. */
+struct SymbolBucketInfo {
+        Scope scope;
+        String name;
+        Symbol symbol;  // -1 if the slot is empty
+};
+
 struct ScopeInfo {
         Scope parentScope;
         Symbol firstSymbol; // speed-up
@@ -454,13 +593,15 @@ struct ProcInfo {
         int nparams;
         Param firstParam;  // speed-up
         Stmt body;
+        Expr firstExpr;  // the body's expressions are contiguous
+        Instr firstInstr;  // bytecode, -1 if not compiled
+        int nregs;  // registers needed by the bytecode
 };
 
 struct ParamInfo {
         Proc proc;
         Symbol sym;
         Type tp;
-        int rank;
 };
 
 struct SymrefExprInfo {
@@ -480,17 +621,14 @@ struct CallExprInfo {
 struct CallArgInfo {
         Expr callExpr;
         Expr argExpr;
-        int rank;
 };
 
 struct UnopExprInfo {
-        int kind;
         Token tok;
         Expr expr;
 };
 
 struct BinopExprInfo {
-        int kind;
         Token tok;
         Expr expr1;
         Expr expr2;
@@ -506,8 +644,11 @@ struct SubscriptExprInfo {
         Expr expr2;
 };
 
+/* 16 bytes: the kind fields, and a union of at most 12 bytes. The type of an
+ * expression, computed by check_types(), is kept apart in exprType. */
 struct ExprInfo {
-        int kind;
+        unsigned char kind;  // EXPR_
+        unsigned char opkind;  // UNOP_ or BINOP_, for EXPR_UNOP and EXPR_BINOP
         union {
                 struct SymrefExprInfo tSymref;
                 struct LiteralExprInfo tLiteral;
@@ -517,7 +658,6 @@ struct ExprInfo {
                 struct MemberExprInfo tMember;
                 struct SubscriptExprInfo tSubscript;
         };
-        Type tp;
 };
 
 struct CompoundStmtInfo {
@@ -567,17 +707,25 @@ struct StmtInfo {
 struct ChildStmtInfo {
         Stmt parent;
         Stmt child;
-        int rank;
+};
+
+struct InstrInfo {
+        int op;  // OP_
+        int a;
+        int b;
+        int c;
 };
 
 
 #ifdef DATA_IMPL
-#define DATA
+#define DATA THREAD_LOCAL
 #else
-#define DATA extern
+#define DATA extern THREAD_LOCAL
 #endif
 
+extern const unsigned char charClass[256];
 extern const char *const tokenKindString[];
+extern const struct PunctuationInfo punctuationInfo[256];
 extern const char *const exprKindString[];
 extern const char *const typeKindString[];
 extern const struct ToktypeToPrefixUnop toktypeToPrefixUnop[];
@@ -585,90 +733,107 @@ extern const struct ToktypeToPostfixUnop toktypeToPostfixUnop[];
 extern const struct ToktypeToBinop toktypeToBinop[];
 extern const struct UnopInfo unopInfo[NUM_UNOPS];
 extern const struct BinopInfo binopInfo[NUM_BINOPS];
+extern const struct KeywordInfo keywordInfo[16];
 extern const struct StringToBeInterned stringsToBeInterned[NUM_CONSTSTRS];
 extern const struct BasetypeToBeInitialized basetypesToBeInitialized[];
 extern const int toktypeToPrefixUnopCnt;
 extern const int toktypeToPostfixUnopCnt;
 extern const int toktypeToBinopCnt;
 extern const int basetypesToBeInitializedCnt;
-DATA String constStr[NUM_CONSTSTRS];  // has initializer
-
-/**/
-
-DATA int doDebug;
-
-DATA File currentFile;
-DATA int currentOffset;
-DATA int haveSavedChar;
-DATA int savedChar;
-
-DATA int haveSavedToken;
-DATA Token savedToken;
-
-DATA Scope globalScope;
-DATA Scope currentScope;
-DATA Scope scopeStack[16];
-DATA int scopeStackCnt;
-
-DATA int lexbufCnt;
-DATA int strbufCnt;
-DATA int stringCnt;
-DATA int strBucketCnt;
-DATA int fileCnt;
-DATA int tokenCnt;
-DATA int typeCnt;
-DATA int paramtypeCnt;
-DATA int symbolCnt;
-DATA int dataCnt;
-DATA int arrayCnt;
-DATA int scopeCnt;
-DATA int procCnt;
-DATA int paramCnt;
-DATA int symrefCnt;
-DATA int exprCnt;
-DATA int stmtCnt;
-DATA int childStmtCnt;
-DATA int callArgCnt;
-
-DATA char *lexbuf;
-DATA char *strbuf;
-DATA struct StringInfo *stringInfo;
-DATA struct StringBucketInfo *strBucketInfo;
-DATA struct FileInfo *fileInfo;
-DATA struct TokenInfo *tokenInfo;
-DATA struct TypeInfo *typeInfo;
-DATA struct ParamtypeInfo *paramtypeInfo;
-DATA struct SymbolInfo *symbolInfo;
-DATA struct DataInfo *dataInfo;
-DATA struct ArrayInfo *arrayInfo;
-DATA struct ScopeInfo *scopeInfo;
-DATA struct ProcInfo *procInfo;
-DATA struct ParamInfo *paramInfo;
-DATA struct SymrefInfo *symrefInfo;
-DATA struct ExprInfo *exprInfo;
-DATA struct StmtInfo *stmtInfo;
-DATA struct ChildStmtInfo *childStmtInfo;
-DATA struct CallArgInfo *callArgInfo;
-
-DATA struct Alloc lexbufAlloc;
-DATA struct Alloc strbufAlloc;
-DATA struct Alloc stringInfoAlloc;
-DATA struct Alloc strBucketInfoAlloc;
-DATA struct Alloc fileInfoAlloc;
-DATA struct Alloc tokenInfoAlloc;
-DATA struct Alloc typeInfoAlloc;
-DATA struct Alloc paramtypeInfoAlloc;
-DATA struct Alloc symbolInfoAlloc;
-DATA struct Alloc dataInfoAlloc;
-DATA struct Alloc arrayInfoAlloc;
-DATA struct Alloc scopeInfoAlloc;
-DATA struct Alloc procInfoAlloc;
-DATA struct Alloc paramInfoAlloc;
-DATA struct Alloc symrefInfoAlloc;
-DATA struct Alloc exprInfoAlloc;
-DATA struct Alloc stmtInfoAlloc;
-DATA struct Alloc childStmtInfoAlloc;
-DATA struct Alloc callArgInfoAlloc;
+/* All state of a compilation lives in the thread-local variables listed
+ * below, so independent compilations can run on different threads. A struct
+ * CompileContext holds the same variables. enter_compile_context() loads a
+ * context into the calling thread's variables, and leave_compile_context()
+ * stores them back. Code that only runs inside a compilation keeps using the
+ * variables directly. */
+
+/* Options. Kept by reset_compile_context(). */
+#define COMPILE_CONTEXT_OPTIONS(X) \
+        X( int,   doDebug,        ) \
+        X( int,   numThreads,     )
+
+/* Scalar state. Cleared by reset_compile_context(). */
+#define COMPILE_CONTEXT_STATE(X) \
+        X( String, constStr,      [NUM_CONSTSTRS] ) \
+        X( File,   currentFile,   ) \
+        X( int,    currentOffset, ) \
+        X( Token,  currentToken,  ) \
+        X( Scope,  globalScope,   ) \
+        X( Scope,  currentScope,  ) \
+        X( Scope,  scopeStack,    [16] ) \
+        X( int,    scopeStackCnt, )
+
+/* Tables: element type, buffer, and element count. Each buffer's struct Alloc
+ * is named after the buffer with an "Alloc" suffix. The buffers are kept by
+ * reset_compile_context() and freed by exit_compile_context(). The last two
+ * are the parser's scratch stacks for lists that are still open. */
+#define COMPILE_CONTEXT_BUFFERS(X) \
+        X( char,                    strbuf,         strbufCnt ) \
+        X( struct StringInfo,       stringInfo,     stringCnt ) \
+        X( struct StringBucketInfo, strBucketInfo,  strBucketCnt ) \
+        X( struct FileInfo,         fileInfo,       fileCnt ) \
+        X( struct TokenLocation,    tokenLocation,  tokenCnt ) \
+        X( long long,               integerLiteral, integerLiteralCnt ) \
+        X( struct TypeInfo,         typeInfo,       typeCnt ) \
+        X( struct ParamtypeInfo,    paramtypeInfo,  paramtypeCnt ) \
+        X( struct SymbolInfo,       symbolInfo,     symbolCnt ) \
+        X( struct SymbolBucketInfo, symBucketInfo,  symBucketCnt ) \
+        X( struct DataInfo,         dataInfo,       dataCnt ) \
+        X( struct ArrayInfo,        arrayInfo,      arrayCnt ) \
+        X( struct ScopeInfo,        scopeInfo,      scopeCnt ) \
+        X( struct ProcInfo,         procInfo,       procCnt ) \
+        X( struct ParamInfo,        paramInfo,      paramCnt ) \
+        X( struct SymrefInfo,       symrefInfo,     symrefCnt ) \
+        X( struct ExprInfo,         exprInfo,       exprCnt ) \
+        X( struct StmtInfo,         stmtInfo,       stmtCnt ) \
+        X( struct ChildStmtInfo,    childStmtInfo,  childStmtCnt ) \
+        X( struct CallArgInfo,      callArgInfo,    callArgCnt ) \
+        X( struct InstrInfo,        instrInfo,      instrCnt ) \
+        X( Stmt,                    childStmtStack, childStmtStackCnt ) \
+        X( Expr,                    callArgStack,   callArgStackCnt )
+
+/* More columns of the tables above. They have the element count of their
+ * table. */
+#define COMPILE_CONTEXT_COLUMNS(X) \
+        X( unsigned char,           tokenKind ) \
+        X( union TokenValue,        tokenValue ) \
+        X( Type,                    exprType ) \
+        X( Type,                    typeCanon ) \
+        X( Token,                   exprToken )
+
+#define X(type, name, dims) DATA type name dims;
+COMPILE_CONTEXT_OPTIONS(X)
+COMPILE_CONTEXT_STATE(X)
+#undef X
+#define X(type, buf, cnt) \
+        DATA int cnt; \
+        DATA type *buf; \
+        DATA struct Alloc buf##Alloc;
+COMPILE_CONTEXT_BUFFERS(X)
+#undef X
+#define X(type, buf) \
+        DATA type *buf; \
+        DATA struct Alloc buf##Alloc;
+COMPILE_CONTEXT_COLUMNS(X)
+#undef X
+
+struct CompileContext {
+#define X(type, name, dims) type name dims;
+        COMPILE_CONTEXT_OPTIONS(X)
+        COMPILE_CONTEXT_STATE(X)
+#undef X
+#define X(type, buf, cnt) \
+        int cnt; \
+        type *buf; \
+        struct Alloc buf##Alloc;
+        COMPILE_CONTEXT_BUFFERS(X)
+#undef X
+#define X(type, buf) \
+        type *buf; \
+        struct Alloc buf##Alloc;
+        COMPILE_CONTEXT_COLUMNS(X)
+#undef X
+};
 
 #ifdef DATA
 #undef DATA
@@ -676,6 +841,8 @@ DATA struct Alloc callArgInfoAlloc;
 
 
 void read_whole_file(File file);
+void close_file(File file);
+void index_lines(File file);
 void mem_fill(void *ptr, int val, int size);
 void mem_copy(void *dst, const void *src, int size);
 int mem_compare(const void *m1, const void *m2, int size);
@@ -684,11 +851,33 @@ int cstr_compare(const char *s1, const char *m2);
 void *mem_realloc(void *ptr, int size);
 void sort_array(void *ptr, int nelems, int elemsize,
                 int (*compare)(const void*, const void*));
+void parallel_for(int nthreads, int cnt, int chunksize,
+                  void (*func)(void *arg, int first, int last), void *arg);
 
 
 
 
+/* Messages that are collected in memory instead of going to stdout. Worker
+ * threads use these to print their messages in a deterministic order. */
+struct MessageBuffer {
+        char *buf;
+        struct Alloc bufAlloc;
+        int bufCnt;
+};
+
+/* Growable byte buffer that the pretty-printer renders into */
+struct OutputBuffer {
+        char *buf;
+        struct Alloc bufAlloc;
+        int bufCnt;
+};
+
 void output(const char *fmt, ...);
+void output_bytes(const char *buf, int len);
+void init_message_buffer(struct MessageBuffer *mb);
+void exit_message_buffer(struct MessageBuffer *mb);
+void set_message_buffer(struct MessageBuffer *mb);
+void flush_message_buffer(struct MessageBuffer *mb);
 void _msg(UNUSED const char *filename, UNUSED int line,
           const char *loglevel, const char *fmt, ...);
 void NORETURN _fatal(const char *filename, int line, const char *fmt, ...);
@@ -702,6 +891,8 @@ void NORETURN _fatal(const char *filename, int line, const char *fmt, ...);
 
 void _buf_init(void **ptr, struct Alloc *alloc, int elsize,
                const char *UNUSED file, int UNUSED line);
+void _buf_init_arena(void **ptr, struct Alloc *alloc, int elsize,
+                     const char *UNUSED file, int UNUSED line);
 void _buf_exit(void **ptr, struct Alloc *alloc, int elsize,
                const char *UNUSED file, int UNUSED line);
 void _buf_reserve(void **ptr, struct Alloc *alloc, int nelems, int elsize,
@@ -710,6 +901,10 @@ void _buf_reserve(void **ptr, struct Alloc *alloc, int nelems, int elsize,
 #define BUF_INIT(buf, alloc) \
         _buf_init((void**)&(buf), &(alloc), sizeof *(buf), __FILE__, __LINE__);
 
+#define BUF_INIT_ARENA(buf, alloc) \
+        _buf_init_arena((void**)&(buf), &(alloc), sizeof *(buf), \
+                        __FILE__, __LINE__);
+
 #define BUF_EXIT(buf, alloc) \
         _buf_exit((void**)&(buf), &(alloc), sizeof *(buf), __FILE__, __LINE__);
 
@@ -723,10 +918,9 @@ void _buf_reserve(void **ptr, struct Alloc *alloc, int nelems, int elsize,
 
 #define BUF_APPEND(buf, alloc, cnt, el) \
         do { \
-                void *ptr = (buf); \
                 int _appendpos = (cnt)++; \
-                _buf_reserve(&ptr, &(alloc), _appendpos+1, sizeof *(buf), 0, \
-                             __FILE__, __LINE__); \
+                _buf_reserve((void**)&(buf), &(alloc), _appendpos+1, \
+                             sizeof *(buf), 0, __FILE__, __LINE__); \
                 (buf)[_appendpos] = el; \
         } while (0)
 
@@ -753,16 +947,44 @@ static inline const char *SRS(Symref ref)
 
 static inline const char *TS(Token tok)
 {
-        return string_buffer(tokenInfo[tok].tWord.string);
+        return string_buffer(tokenValue[tok].string);
 }
 
 static inline const char *TKS(Token tok)
 {
-        return tokenKindString[tokenInfo[tok].kind];
+        return tokenKindString[tokenKind[tok]];
 }
 
+void find_expr_position(Expr x, File *file, int *offset);
+int compute_lineno(File file, int offset);
+int compute_colno(File file, int offset);
+Symbol find_symbol_in_scope(String name, Scope scope);
+
+void reserve_strings(int nstrings);
 String intern_string(const void *buf, int len);
 String intern_cstring(const char *str);
+void init_string_arena(struct StringArena *arena, int nstrings);
+void exit_string_arena(struct StringArena *arena);
+String arena_intern_string(struct StringArena *arena,
+                           const void *buf, int len);
+void merge_string_arena(struct StringArena *arena, String *map);
+
+
+void init_compile_context(struct CompileContext *ctx, int useArena);
+void exit_compile_context(struct CompileContext *ctx);
+void reset_compile_context(struct CompileContext *ctx);
+void enter_compile_context(const struct CompileContext *ctx);
+void leave_compile_context(struct CompileContext *ctx);
 
 
+void init_output_buffer(struct OutputBuffer *ob);
+void exit_output_buffer(struct OutputBuffer *ob);
+void prettyprint_to_buffer(struct OutputBuffer *ob);
 void prettyprint(void);
+
+void compile_bytecode(void);
+long long run_proc(Proc proc);
+void NORETURN bytecode_trap(int trap, Expr x);
+void NORETURN runtime_error(int error, long long arg);
+
+long long run_native(Proc proc);
@@ -1,44 +1,55 @@
 #include "defs.h"
 #include "api.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 File add_file(String filepath)
 {
         File x = fileCnt++;
         BUF_RESERVE(fileInfo, fileInfoAlloc, fileCnt);
         fileInfo[x].filepath = filepath;
+        fileInfo[x].lineCnt = 0;
+        BUF_INIT(fileInfo[x].lineStart, fileInfo[x].lineStartAlloc);
         read_whole_file(x);
         return x;
 }
 
-Token add_word_token(File file, int offset, const char *string, int length)
+static inline Token add_token(struct FileTokens *ft, int offset, int kind)
 {
-        Token x = tokenCnt++;
-        BUF_RESERVE(tokenInfo, tokenInfoAlloc, tokenCnt);
-        tokenInfo[x].file = file;
-        tokenInfo[x].offset = offset;
-        tokenInfo[x].kind = TOKTYPE_WORD;
-        tokenInfo[x].tWord.string = intern_string(string, length);
+        Token x = ft->tokenCnt++;
+        if (ft->kindAlloc.cap < ft->tokenCnt) {
+                BUF_RESERVE(ft->kind, ft->kindAlloc, ft->tokenCnt);
+                BUF_RESERVE(ft->value, ft->valueAlloc, ft->tokenCnt);
+                BUF_RESERVE(ft->offset, ft->offsetAlloc, ft->tokenCnt);
+        }
+        ft->kind[x] = (unsigned char) kind;
+        ft->offset[x] = offset;
+        return x;
+}
+
+Token add_word_token(struct FileTokens *ft, int offset,
+                     const char *string, int length)
+{
+        Token x = add_token(ft, offset, TOKTYPE_WORD);
+        ft->value[x].string = arena_intern_string(&ft->strings, string, length);
         return x;
 }
 
-Token add_integer_token(File file, int offset, long long value)
+Token add_integer_token(struct FileTokens *ft, int offset, long long value)
 {
-        Token x = tokenCnt++;
-        BUF_RESERVE(tokenInfo, tokenInfoAlloc, tokenCnt);
-        tokenInfo[x].file = file;
-        tokenInfo[x].offset = offset;
-        tokenInfo[x].kind = TOKTYPE_INTEGER;
-        tokenInfo[x].tInteger.value = value;
+        Token x = add_token(ft, offset, TOKTYPE_INTEGER);
+        int lit = ft->literalCnt++;
+        BUF_RESERVE(ft->literal, ft->literalAlloc, ft->literalCnt);
+        ft->literal[lit] = value;
+        ft->value[x].literal = lit;
         return x;
 }
 
-Token add_bare_token(File file, int offset, int kind)
+Token add_bare_token(struct FileTokens *ft, int offset, int kind)
 {
-        Token x = tokenCnt++;
-        BUF_RESERVE(tokenInfo, tokenInfoAlloc, tokenCnt);
-        tokenInfo[x].file = file;
-        tokenInfo[x].offset = offset;
-        tokenInfo[x].kind = kind;
+        Token x = add_token(ft, offset, kind);
+        ft->value[x].literal = -1;
         return x;
 }
 
@@ -210,6 +221,9 @@ Proc add_proc(Type tp, Scope scope)
         procInfo[x].firstParam = -1;
         procInfo[x].nparams = 0;
         procInfo[x].body = -1;
+        procInfo[x].firstExpr = -1;
+        procInfo[x].firstInstr = -1;
+        procInfo[x].nregs = 0;
         return x;
 }
 
@@ -217,35 +231,40 @@ Symref add_symref(Token tok, Scope refScope)
 {
         Symref ref = symrefCnt++;
         BUF_RESERVE(symrefInfo, symrefInfoAlloc, symrefCnt);
-        symrefInfo[ref].name = tokenInfo[tok].tWord.string;
+        symrefInfo[ref].name = tokenValue[tok].string;
         symrefInfo[ref].refScope = refScope;
         symrefInfo[ref].tok = tok;
         return ref;
 }
 
-Expr add_symref_expr(Symref ref)
+/* tok is where the expression starts, as reported in messages */
+static inline Expr add_expr(int kind, Token tok)
 {
         Expr x = exprCnt++;
         BUF_RESERVE(exprInfo, exprInfoAlloc, exprCnt);
-        exprInfo[x].kind = EXPR_SYMREF;
+        BUF_RESERVE(exprToken, exprTokenAlloc, exprCnt);
+        exprInfo[x].kind = (unsigned char) kind;
+        exprToken[x] = tok;
+        return x;
+}
+
+Expr add_symref_expr(Symref ref)
+{
+        Expr x = add_expr(EXPR_SYMREF, symrefInfo[ref].tok);
         exprInfo[x].tSymref.ref = ref;
         return x;
 }
 
 Expr add_literal_expr(Token tok)
 {
-        Expr x = exprCnt++;
-        BUF_RESERVE(exprInfo, exprInfoAlloc, exprCnt);
-        exprInfo[x].kind = EXPR_LITERAL;
+        Expr x = add_expr(EXPR_LITERAL, tok);
         exprInfo[x].tLiteral.tok = tok;
         return x;
 }
 
 Expr add_call_expr(Expr callee)
 {
-        Expr x = exprCnt++;
-        BUF_RESERVE(exprInfo, exprInfoAlloc, exprCnt);
-        exprInfo[x].kind = EXPR_CALL;
+        Expr x = add_expr(EXPR_CALL, exprToken[callee]);
         exprInfo[x].tCall.callee = callee;
         exprInfo[x].tCall.firstArgIdx = -1;
         exprInfo[x].tCall.nargs = 0;
@@ -254,10 +273,8 @@ Expr add_call_expr(Expr callee)
 
 Expr add_unop_expr(int opkind, Token tok, Expr expr)
 {
-        Expr x = exprCnt++;
-        BUF_RESERVE(exprInfo, exprInfoAlloc, exprCnt);
-        exprInfo[x].kind = EXPR_UNOP;
-        exprInfo[x].tUnop.kind = opkind;
+        Expr x = add_expr(EXPR_UNOP, tok);
+        exprInfo[x].opkind = (unsigned char) opkind;
         exprInfo[x].tUnop.tok = tok;
         exprInfo[x].tUnop.expr = expr;
         return x;
@@ -265,10 +282,8 @@ Expr add_unop_expr(int opkind, Token tok, Expr expr)
 
 Expr add_binop_expr(int opkind, Token tok, Expr expr1, Expr expr2)
 {
-        Expr x = exprCnt++;
-        BUF_RESERVE(exprInfo, exprInfoAlloc, exprCnt);
-        exprInfo[x].kind = EXPR_BINOP;
-        exprInfo[x].tBinop.kind = opkind;
+        Expr x = add_expr(EXPR_BINOP, exprToken[expr1]);
+        exprInfo[x].opkind = (unsigned char) opkind;
         exprInfo[x].tBinop.tok = tok;
         exprInfo[x].tBinop.expr1 = expr1;
         exprInfo[x].tBinop.expr2 = expr2;
@@ -277,9 +292,7 @@ Expr add_binop_expr(int opkind, Token tok, Expr expr1, Expr expr2)
 
 Expr add_member_expr(Expr expr, String name)
 {
-        Expr x = exprCnt++;
-        BUF_RESERVE(exprInfo, exprInfoAlloc, exprCnt);
-        exprInfo[x].kind = EXPR_MEMBER;
+        Expr x = add_expr(EXPR_MEMBER, exprToken[expr]);
         exprInfo[x].tMember.expr = expr;
         exprInfo[x].tMember.name = name;
         return x;
@@ -287,9 +300,7 @@ Expr add_member_expr(Expr expr, String name)
 
 Expr add_subscript_expr(Expr expr1, Expr expr2)
 {
-        Expr x = exprCnt++;
-        BUF_RESERVE(exprInfo, exprInfoAlloc, exprCnt);
-        exprInfo[x].kind = EXPR_SUBSCRIPT;
+        Expr x = add_expr(EXPR_SUBSCRIPT, exprToken[expr1]);
         exprInfo[x].tSubscript.expr1 = expr1;
         exprInfo[x].tSubscript.expr2 = expr2;
         return x;
@@ -380,26 +391,61 @@ Param add_Param(Proc proc, Type tp)
         paramInfo[x].proc = proc;
         paramInfo[x].sym = -1; // later
         paramInfo[x].tp = tp;
-        paramInfo[x].rank = x;
         return x;
 }
 
-void add_ChildStmt(Stmt parent, Stmt child)
+/* Child statements and call arguments are pushed on a scratch stack while
+ * their list is being parsed. Lists can nest, so each list only owns the top
+ * of the stack from the position where it started. When the list is closed,
+ * its items are moved to the table in one piece. That way the items of each
+ * list are contiguous and in order without any sorting. */
+
+void push_ChildStmt(Stmt child)
+{
+        int x = childStmtStackCnt++;
+        BUF_RESERVE(childStmtStack, childStmtStackAlloc, childStmtStackCnt);
+        childStmtStack[x] = child;
+}
+
+void commit_ChildStmts(Stmt parent, int stackStart)
 {
-        int x = childStmtCnt++;
+        int n = childStmtStackCnt - stackStart;
+        int first = childStmtCnt;
+        childStmtCnt += n;
         BUF_RESERVE(childStmtInfo, childStmtInfoAlloc, childStmtCnt);
-        childStmtInfo[x].parent = parent;
-        childStmtInfo[x].child = child;
-        childStmtInfo[x].rank = x;
+        for (int i = 0; i < n; i++) {
+                childStmtInfo[first + i].parent = parent;
+                childStmtInfo[first + i].child = childStmtStack[stackStart + i];
+        }
+        childStmtStackCnt = stackStart;
+        if (n > 0) {
+                stmtInfo[parent].tCompound.numStatements = n;
+                stmtInfo[parent].tCompound.firstChildStmtIdx = first;
+        }
 }
 
-void add_CallArg(Expr callExpr, Expr argExpr)
+void push_CallArg(Expr argExpr)
 {
-        int x = callArgCnt++;
+        int x = callArgStackCnt++;
+        BUF_RESERVE(callArgStack, callArgStackAlloc, callArgStackCnt);
+        callArgStack[x] = argExpr;
+}
+
+void commit_CallArgs(Expr callExpr, int stackStart)
+{
+        int n = callArgStackCnt - stackStart;
+        int first = callArgCnt;
+        callArgCnt += n;
         BUF_RESERVE(callArgInfo, callArgInfoAlloc, callArgCnt);
-        callArgInfo[x].callExpr = callExpr;
-        callArgInfo[x].argExpr = argExpr;
-        callArgInfo[x].rank = x;
+        for (int i = 0; i < n; i++) {
+                callArgInfo[first + i].callExpr = callExpr;
+                callArgInfo[first + i].argExpr = callArgStack[stackStart + i];
+        }
+        callArgStackCnt = stackStart;
+        if (n > 0) {
+                exprInfo[callExpr].tCall.nargs = n;
+                exprInfo[callExpr].tCall.firstArgIdx = first;
+        }
 }
 
 void init_strings(void)
@@ -421,72 +467,135 @@ void init_basetypes(void)
         }
 }
 
-void find_expr_position(Expr x, File *file, int *offset)
-{
-        // TODO: should this be added as hard data to ExprInfo?
-        Token tok = -1;
-        for (;;) {
-                switch (exprInfo[x].kind) {
-                case EXPR_LITERAL:
-                        tok = exprInfo[x].tLiteral.tok;
-                        break;
-                case EXPR_SYMREF:
-                        tok = symrefInfo[exprInfo[x].tSymref.ref].tok;
-                        break;
-                case EXPR_UNOP:
-                        tok = exprInfo[x].tUnop.tok;
-                        break;
-                case EXPR_BINOP:
-                        x = exprInfo[x].tBinop.expr1;
-                        continue;
-                case EXPR_MEMBER:
-                        x = exprInfo[x].tMember.expr;
-                        continue;
-                case EXPR_SUBSCRIPT:
-                        x = exprInfo[x].tSubscript.expr1;
-                        continue;
-                case EXPR_CALL:
-                        x = exprInfo[x].tCall.callee;
-                        continue;
-                default:
-                        UNHANDLED_CASE();
-                }
-                break;
-        }
-        assert(tok != -1);
-        *file = tokenInfo[tok].file;
-        *offset = tokenInfo[tok].offset;
-}
-
-int char_is_alpha(int c)
-{
-        return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
-}
-
-int char_is_digit(int c)
-{
-        return '0' <= c && c <= '9';
-}
-
-int char_is_whitespace(int c)
-{
-        return c == ' ' || c == '\n';
+void enter_compile_context(const struct CompileContext *ctx)
+{
+#define X(type, name, dims) mem_copy(&name, &ctx->name, sizeof name);
+        COMPILE_CONTEXT_OPTIONS(X)
+        COMPILE_CONTEXT_STATE(X)
+#undef X
+#define X(type, buf, cnt) \
+        cnt = ctx->cnt; \
+        buf = ctx->buf; \
+        buf##Alloc = ctx->buf##Alloc;
+        COMPILE_CONTEXT_BUFFERS(X)
+#undef X
+#define X(type, buf) \
+        buf = ctx->buf; \
+        buf##Alloc = ctx->buf##Alloc;
+        COMPILE_CONTEXT_COLUMNS(X)
+#undef X
+}
+
+void leave_compile_context(struct CompileContext *ctx)
+{
+#define X(type, name, dims) mem_copy(&ctx->name, &name, sizeof name);
+        COMPILE_CONTEXT_OPTIONS(X)
+        COMPILE_CONTEXT_STATE(X)
+#undef X
+#define X(type, buf, cnt) \
+        ctx->cnt = cnt; \
+        ctx->buf = buf; \
+        ctx->buf##Alloc = buf##Alloc;
+        COMPILE_CONTEXT_BUFFERS(X)
+#undef X
+#define X(type, buf) \
+        ctx->buf = buf; \
+        ctx->buf##Alloc = buf##Alloc;
+        COMPILE_CONTEXT_COLUMNS(X)
+#undef X
+}
+
+/* The functions below work on the given context, and leave the context of
+ * the calling thread as it was. */
+
+/* With useArena, the tables are arena buffers (see BUF_INIT_ARENA). They
+ * don't move or get copied when they grow, and exit_compile_context() releases
+ * each of them with a single call. */
+void init_compile_context(struct CompileContext *ctx, int useArena)
+{
+        struct CompileContext saved;
+
+        leave_compile_context(&saved);
+        CLEAR(*ctx);
+        ctx->numThreads = 1;
+        if (useArena) {
+#define X(type, buf, cnt) BUF_INIT_ARENA(ctx->buf, ctx->buf##Alloc);
+                COMPILE_CONTEXT_BUFFERS(X)
+#undef X
+#define X(type, buf) BUF_INIT_ARENA(ctx->buf, ctx->buf##Alloc);
+                COMPILE_CONTEXT_COLUMNS(X)
+#undef X
+        }
+        enter_compile_context(ctx);
+        init_strings();
+        init_basetypes();
+        leave_compile_context(ctx);
+        enter_compile_context(&saved);
+}
+
+void exit_compile_context(struct CompileContext *ctx)
+{
+        struct CompileContext saved;
+
+        leave_compile_context(&saved);
+        enter_compile_context(ctx);
+        for (File file = 0; file < fileCnt; file++)
+                close_file(file);
+#define X(type, buf, cnt) BUF_EXIT(buf, buf##Alloc);
+        COMPILE_CONTEXT_BUFFERS(X)
+#undef X
+#define X(type, buf) BUF_EXIT(buf, buf##Alloc);
+        COMPILE_CONTEXT_COLUMNS(X)
+#undef X
+        CLEAR(*ctx);
+        enter_compile_context(&saved);
+}
+
+/* Makes the context ready for a new compilation. Unlike exit and init, this
+ * keeps the allocated table buffers, so reusing a context for many small
+ * compilations does not allocate again. */
+void reset_compile_context(struct CompileContext *ctx)
+{
+        struct CompileContext saved;
+        int nbuckets;
+
+        leave_compile_context(&saved);
+        enter_compile_context(ctx);
+        for (File file = 0; file < fileCnt; file++)
+                close_file(file);
+        /* The string table keeps its size, just with all slots empty */
+        nbuckets = strBucketCnt;
+#define X(type, name, dims) CLEAR(name);
+        COMPILE_CONTEXT_STATE(X)
+#undef X
+#define X(type, buf, cnt) cnt = 0;
+        COMPILE_CONTEXT_BUFFERS(X)
+#undef X
+        strBucketCnt = nbuckets;
+        for (int i = 0; i < strBucketCnt; i++)
+                strBucketInfo[i].string = -1;
+        init_strings();
+        init_basetypes();
+        leave_compile_context(ctx);
+        enter_compile_context(&saved);
 }
 
-int char_is_invalid(int c)
+void find_expr_position(Expr x, File *file, int *offset)
 {
-        return c < 32 && ! char_is_whitespace(c);
+        Token tok = exprToken[x];
+        *file = tokenLocation[tok].file;
+        *offset = tokenLocation[tok].offset;
 }
 
 int token_is_word(Token tok, String string)
 {
-        return tokenInfo[tok].kind == TOKTYPE_WORD &&
-                tokenInfo[tok].tWord.string == string;
+        return tokenKind[tok] == TOKTYPE_WORD &&
+                tokenValue[tok].string == string;
 }
 
 int token_is_unary_prefix_operator(Token tok, int *out_optype)
 {
-        int tp = tokenInfo[tok].kind;
+        int tp = tokenKind[tok];
         for (int i = 0; i < toktypeToPrefixUnopCnt; i++) {
                 if (tp == toktypeToPrefixUnop[i].ttype) {
                         *out_optype = toktypeToPrefixUnop[i].optype;
@@ -498,7 +607,7 @@ int token_is_unary_prefix_operator(Token tok, int *out_optype)
 
 int token_is_unary_postfix_operator(Token tok, int *out_optype)
 {
-        int tp = tokenInfo[tok].kind;
+        int tp = tokenKind[tok];
         for (int i = 0; i < toktypeToPostfixUnopCnt; i++) {
                 if (tp == toktypeToPostfixUnop[i].ttype) {
                         *out_optype = toktypeToPostfixUnop[i].optype;
@@ -510,7 +619,7 @@ int token_is_unary_postfix_operator(Token tok, int *out_optype)
 
 int token_is_binary_infix_operator(Token tok, int *out_optp)
 {
-        int tp = tokenInfo[tok].kind;
+        int tp = tokenKind[tok];
         for (int i = 0; i < toktypeToBinopCnt; i++) {
                 if (tp == toktypeToBinop[i].ttype) {
                         *out_optp = toktypeToBinop[i].optype;
@@ -520,30 +629,38 @@ int token_is_binary_infix_operator(Token tok, int *out_optp)
         return 0;
 }
 
+/* Index of the line containing offset, counting from 0. Offset may be 1 past
+ * the end of file (i.e., equal to file size) */
+int find_line(File file, int offset)
+{
+        int lo = 0;
+        int hi;
+
+        if (fileInfo[file].lineCnt == 0)
+                index_lines(file);
+        hi = fileInfo[file].lineCnt;
+        /* find last line start <= offset. lineStart[0] is always 0 */
+        while (hi - lo > 1) {
+                int mid = lo + (hi - lo) / 2;
+                if (fileInfo[file].lineStart[mid] <= offset)
+                        lo = mid;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
 /* offset may be 1 past the end of file (i.e., equal to file size) */
 int compute_lineno(File file, int offset)
 {
-        int i;
-        int line = 1;
-
-        for (i = 0; i < offset; i++)
-                if (fileInfo[file].buf[i] == '\n')
-                        line++;
-        return line;
+        return find_line(file, offset) + 1;
 }
 
 /* offset may be 1 past the end of file (i.e., equal to file size) */
 int compute_colno(File file, int offset)
 {
-        int i;
-        int column = 1;
-
-        for (i = 0; i < offset; i++)
-                if (fileInfo[file].buf[i] == '\n')
-                        column = 1;
-                else
-                        column ++;
-        return column;
+        int line = find_line(file, offset);
+        return offset - fileInfo[file].lineStart[line] + 1;
 }
 
 #define MSG_AT(lvl, file, offset, fmt, ...) \
@@ -553,7 +670,8 @@ int compute_colno(File file, int offset)
               compute_colno(file, offset), \
               ##__VA_ARGS__)
 #define MSG_AT_TOK(lvl, tok, fmt, ...) \
-        MSG_AT(lvl, currentFile, tokenInfo[tok].offset, fmt, ##__VA_ARGS__)
+        MSG_AT(lvl, tokenLocation[tok].file, tokenLocation[tok].offset, \
+               fmt, ##__VA_ARGS__)
 #define FATAL_PARSE_ERROR_AT(file, offset, fmt, ...) \
         FATAL("At %s %d:%d: " fmt, \
               string_buffer(fileInfo[file].filepath), \
@@ -568,12 +686,11 @@ int compute_colno(File file, int offset)
                 MSG_AT("WARN", x_file, x_offset, fmt, ##__VA_ARGS__); \
         } while (0)
 #define FATAL_PARSE_ERROR(tok, fmt, ...) \
-        FATAL("At %s %d:%d: ERROR parsing %s token. " fmt, \
-              string_buffer(fileInfo[tokenInfo[tok].file].filepath), \
-              compute_lineno(tokenInfo[tok].file, tokenInfo[tok].offset), \
-              compute_colno(tokenInfo[tok].file, tokenInfo[tok].offset), \
-              tokenKindString[tokenInfo[tok].kind], \
-              ##__VA_ARGS__)
+        FATAL_PARSE_ERROR_AT(tokenLocation[tok].file, \
+                             tokenLocation[tok].offset, \
+                             "ERROR parsing %s token. " fmt, \
+                             tokenKindString[tokenKind[tok]], \
+                             ##__VA_ARGS__)
 #define LOG_TYPE_ERROR_EXPR(x, fmt, ...) \
         do { \
                 File x_file; \
@@ -586,35 +703,6 @@ int compute_colno(File file, int offset)
                 MSG_AT("PARSE", currentFile, currentOffset, \
                        "%s()\n", __func__);
 
-int look_char(void)
-{
-        if (! haveSavedChar) {
-                if (currentOffset < fileInfo[currentFile].size) {
-                        haveSavedChar = 1;
-                        int c = fileInfo[currentFile].buf[currentOffset];
-                        if (char_is_invalid(c)) {
-                                FATAL_PARSE_ERROR_AT(currentFile, currentOffset,
-                                                     "Invalid byte %d\n", c);
-                        }
-                        savedChar = c;
-                }
-                else {
-                        savedChar = -1;
-                }
-        }
-        return savedChar;
-}
-
-int read_char(void)
-{
-        int c = look_char();
-        if (c != -1) {
-                currentOffset++;
-                haveSavedChar = 0;
-        }
-        return c;
-}
-
 void push_scope(Scope scope)
 {
         if (scopeStackCnt >= LENGTH(scopeStack))
@@ -631,191 +719,279 @@ void pop_scope(void)
         currentScope = scopeStack[scopeStackCnt-1];
 }
 
-Token parse_next_token(void)
-{
-        int c;
-        int off;
-        Token ans;
+/* The scan_*() functions return the position of the first byte at or after
+ * pos that does not belong to the respective run. They rely on the '\0'
+ * sentinel at buf[size], which terminates every run, and use SSE2 only as long
+ * as a whole vector fits before the end of the buffer. */
+
+#ifdef __SSE2__
+/* mask of bytes in the range [lo, hi] (unsigned comparison) */
+static inline __m128i sse2_range_mask(__m128i v, unsigned char lo,
+                                      unsigned char hi)
+{
+        __m128i t = _mm_sub_epi8(v, _mm_set1_epi8((char) lo));
+        t = _mm_xor_si128(t, _mm_set1_epi8((char) 0x80));
+        return _mm_cmplt_epi8(t, _mm_set1_epi8((char) (hi - lo + 1 + 0x80)));
+}
+#endif
+
+static int scan_whitespace(const unsigned char *buf, int pos, int size)
+{
+#ifdef __SSE2__
+        for (; pos + 16 <= size; pos += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *) &buf[pos]);
+                __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+                unsigned mask = ~_mm_movemask_epi8(m) & 0xffff;
+                if (mask)
+                        return pos + __builtin_ctz(mask);
+        }
+#else
+        (void) size;
+#endif
+        while (charClass[buf[pos]] == CHARCLASS_WHITESPACE)
+                pos++;
+        return pos;
+}
+
+static int scan_word(const unsigned char *buf, int pos, int size)
+{
+#ifdef __SSE2__
+        for (; pos + 16 <= size; pos += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *) &buf[pos]);
+                __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+                __m128i m = _mm_or_si128(sse2_range_mask(lower, 'a', 'z'),
+                                         sse2_range_mask(v, '0', '9'));
+                unsigned mask = ~_mm_movemask_epi8(m) & 0xffff;
+                if (mask)
+                        return pos + __builtin_ctz(mask);
+        }
+#else
+        (void) size;
+#endif
+        while (charClass[buf[pos]] == CHARCLASS_ALPHA ||
+               charClass[buf[pos]] == CHARCLASS_DIGIT)
+                pos++;
+        return pos;
+}
+
+/* Stops at the next '*' or invalid byte */
+static int scan_comment(const unsigned char *buf, int pos, int size)
+{
+#ifdef __SSE2__
+        for (; pos + 16 <= size; pos += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *) &buf[pos]);
+                __m128i ctrl = _mm_andnot_si128(
+                        _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                        sse2_range_mask(v, 0, 31));
+                __m128i m = _mm_or_si128(ctrl,
+                                         _mm_cmpeq_epi8(v, _mm_set1_epi8('*')));
+                unsigned mask = _mm_movemask_epi8(m);
+                if (mask)
+                        return pos + __builtin_ctz(mask);
+        }
+#else
+        (void) size;
+#endif
+        while (buf[pos] != '*' && charClass[buf[pos]] != CHARCLASS_INVALID)
+                pos++;
+        return pos;
+}
+
+/* Returns the TOKTYPE_ of the keyword, or -1 if the word is not a keyword */
+static inline int lookup_keyword(const unsigned char *word, int length)
+{
+        const struct KeywordInfo *kw =
+                &keywordInfo[KEYWORD_HASH(word[0], word[length - 1])];
+        if (kw->length == length &&
+            mem_compare(kw->string, word, length) == 0)
+                return kw->kind;
+        return -1;
+}
 
-        if (haveSavedToken) {
-                haveSavedToken = 0;
-                return savedToken;
-        }
-retry:
+/* Lexes a file into ft. This only reads the file's buffer and writes to ft, so
+ * different files can be lexed on different threads. */
+void lex_file(File file, struct FileTokens *ft)
+{
+        const unsigned char *buf = fileInfo[file].buf;
+        int size = fileInfo[file].size;
+        int pos = 0;
 
         for (;;) {
-                c = read_char();
-                if (c == -1)
-                        return -1;
-                if (char_is_whitespace(c))
-                        continue;
-                if (c != '/')
+                pos = scan_whitespace(buf, pos, size);
+                if (pos >= size)
                         break;
-                /* comment? */
-                if (c == '/') {
-                        c = look_char();
-                        if (c != '*')
-                                break;
-                }
-                for (;;) {
-                        read_char();
-                        c = look_char();
-                        if (c == '*') {
-                                read_char();
-                                c = look_char();
-                                if (c == '/') {
-                                        read_char();
-                                        goto retry;
-                                }
-                        }
-                        if (c == -1) {
-                                FATAL_PARSE_ERROR_AT(
-                                        currentFile, currentOffset,
-                                        "EOF with unclosed comment\n");
+
+                int c = buf[pos];
+                int off = pos++;
+
+                /* A '/' that doesn't start a comment is a TOKTYPE_SLASH
+                 * (division) token from the punctuation table below. */
+                if (c == '/' && buf[pos] == '*') {
+                        for (pos++;; pos++) {
+                                pos = scan_comment(buf, pos, size);
+                                if (pos >= size)
+                                        FATAL_PARSE_ERROR_AT(file, pos,
+                                                "EOF with unclosed comment\n");
+                                if (buf[pos] != '*')
+                                        FATAL_PARSE_ERROR_AT(file, pos,
+                                                "Invalid byte %d\n", buf[pos]);
+                                if (buf[pos + 1] == '/')
+                                        break;
                         }
+                        pos += 2;
+                        continue;
                 }
-        }
 
-        /* good to go. Variable c contains first character to lex */
-        off = currentOffset - 1;
-        if (char_is_alpha(c)) {
-                lexbufCnt = 0;
-                for (;;) {
-                        int idx = lexbufCnt++;
-                        BUF_RESERVE(lexbuf, lexbufAlloc, lexbufCnt);
-                        lexbuf[idx] = (char) c;
-                        c = look_char();
-                        if (! char_is_alpha(c) && ! char_is_digit(c))
-                                break;
-                        read_char();
+                if (charClass[c] == CHARCLASS_ALPHA) {
+                        pos = scan_word(buf, pos, size);
+                        int kw = lookup_keyword(&buf[off], pos - off);
+                        if (kw != -1)
+                                add_bare_token(ft, off, kw);
+                        else
+                                add_word_token(ft, off,
+                                               (const char *) &buf[off],
+                                               pos - off);
                 }
-                ans = add_word_token(currentFile, off, lexbuf, lexbufCnt);
-        }
-        else if (char_is_digit(c)) {
-                long long x = c - '0';
-                for (;;) {
-                        c = look_char();
-                        if (! char_is_digit(c))
-                                break;
-                        read_char();
-                        x = 10 * x + c - '0';
+                else if (charClass[c] == CHARCLASS_DIGIT) {
+                        long long x = c - '0';
+                        while (charClass[buf[pos]] == CHARCLASS_DIGIT)
+                                x = 10 * x + buf[pos++] - '0';
+                        add_integer_token(ft, off, x);
                 }
-                ans = add_integer_token(currentFile, off, x);
-        }
-        else if (c == '(') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_LEFTPAREN);
-        }
-        else if (c == ')') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_RIGHTPAREN);
-        }
-        else if (c == '{') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_LEFTBRACE);
-        }
-        else if (c == '}') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_RIGHTBRACE);
-        }
-        else if (c == '[') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_LEFTBRACKET);
-        }
-        else if (c == ']') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_RIGHTBRACKET);
-        }
-        else if (c == '.') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_DOT);
-        }
-        else if (c == '-') {
-                c = look_char();
-                if (c == '-') {
-                        read_char();
-                        ans = add_bare_token(currentFile, off,
-                                             TOKTYPE_DOUBLEMINUS);
+                else if (charClass[c] == CHARCLASS_INVALID) {
+                        FATAL_PARSE_ERROR_AT(file, off,
+                                             "Invalid byte %d\n", c);
                 }
                 else {
-                        ans = add_bare_token(currentFile, off,
-                                             TOKTYPE_MINUS);
-                }
-        }
-        else if (c == '+') {
-                c = look_char();
-                if (c == '+') {
-                        read_char();
-                        ans = add_bare_token(currentFile, off,
-                                             TOKTYPE_DOUBLEPLUS);
-                }
-                else {
-                        ans = add_bare_token(currentFile, off, TOKTYPE_PLUS);
-                }
-        }
-        else if (c == '*') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_ASTERISK);
-        }
-        else if (c == '/') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_SLASH);
-        }
-        else if (c == ',') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_COMMA);
-        }
-        else if (c == ';') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_SEMICOLON);
-        }
-        else if (c == ':') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_COLON);
-        }
-        else if (c == '&') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_AMPERSAND);
-        }
-        else if (c == '|') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_PIPE);
-        }
-        else if (c == '^') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_CARET);
-        }
-        else if (c == '~') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_TILDE);
-        }
-        else if (c == '!') {
-                ans = add_bare_token(currentFile, off, TOKTYPE_BANG);
-        }
-        else if (c == '=') {
-                c = look_char();
-                if (c == '=') {
-                        read_char();
-                        ans = add_bare_token(currentFile, off,
-                                             TOKTYPE_DOUBLEEQUALS);
-                }
-                else {
-                        ans = add_bare_token(currentFile, off,
-                                             TOKTYPE_ASSIGNEQUALS);
+                        const struct PunctuationInfo *pi = &punctuationInfo[c];
+                        if (! pi->isValid)
+                                FATAL_PARSE_ERROR_AT(file, off,
+                                                     "Failed to lex token\n");
+                        if (pi->secondChar && buf[pos] == pi->secondChar) {
+                                pos++;
+                                add_bare_token(ft, off, pi->doubleKind);
+                        }
+                        else {
+                                add_bare_token(ft, off, pi->kind);
+                        }
                 }
         }
-        else {
-                FATAL_PARSE_ERROR_AT(currentFile, currentOffset,
-                                     "Failed to lex token\n");
-        }
+}
 
-        return ans;
+/* Appends the tokens of a file, lexed by lex_file(), to the token table. */
+void merge_file_tokens(File file, struct FileTokens *ft)
+{
+        String *map;
+        struct Alloc mapAlloc;
+
+        BUF_INIT(map, mapAlloc);
+        BUF_RESERVE(map, mapAlloc, ft->strings.stringCnt);
+        merge_string_arena(&ft->strings, map);
+
+        BUF_RESERVE(tokenKind, tokenKindAlloc, tokenCnt + ft->tokenCnt);
+        BUF_RESERVE(tokenValue, tokenValueAlloc, tokenCnt + ft->tokenCnt);
+        BUF_RESERVE(tokenLocation, tokenLocationAlloc,
+                    tokenCnt + ft->tokenCnt);
+        BUF_RESERVE(integerLiteral, integerLiteralAlloc,
+                    integerLiteralCnt + ft->literalCnt);
+        mem_copy(&tokenKind[tokenCnt], ft->kind, ft->tokenCnt);
+        mem_copy(&integerLiteral[integerLiteralCnt], ft->literal,
+                 ft->literalCnt * (int) sizeof *ft->literal);
+        fileInfo[file].firstToken = tokenCnt;
+        fileInfo[file].numTokens = ft->tokenCnt;
+        for (int i = 0; i < ft->tokenCnt; i++) {
+                Token x = tokenCnt + i;
+                tokenValue[x] = ft->value[i];
+                if (ft->kind[i] == TOKTYPE_WORD)
+                        tokenValue[x].string = map[ft->value[i].string];
+                else if (ft->kind[i] == TOKTYPE_INTEGER)
+                        tokenValue[x].literal += integerLiteralCnt;
+                tokenLocation[x].file = file;
+                tokenLocation[x].offset = ft->offset[i];
+        }
+        tokenCnt += ft->tokenCnt;
+        integerLiteralCnt += ft->literalCnt;
+        BUF_EXIT(map, mapAlloc);
+}
+
+static void lex_files_worker(void *arg, int first, int last)
+{
+        struct FileTokens *ft = arg;
+        for (File file = first; file < last; file++)
+                lex_file(file, &ft[file]);
+}
+
+/* Lexes all files, in parallel if numThreads > 1. Tokens and Strings are
+ * numbered exactly as if the files were lexed one after the other. */
+void lex_all_files(void)
+{
+        struct FileTokens *ft;
+        struct Alloc ftAlloc;
+
+        BUF_INIT(ft, ftAlloc);
+        BUF_RESERVE(ft, ftAlloc, fileCnt);
+        for (File file = 0; file < fileCnt; file++) {
+                BUF_INIT(ft[file].kind, ft[file].kindAlloc);
+                BUF_INIT(ft[file].value, ft[file].valueAlloc);
+                BUF_INIT(ft[file].offset, ft[file].offsetAlloc);
+                BUF_INIT(ft[file].literal, ft[file].literalAlloc);
+                ft[file].tokenCnt = 0;
+                ft[file].literalCnt = 0;
+                /* generously one distinct word per 32 bytes, so lexing
+                 * normally never resizes the arena's table. The table then
+                 * costs up to 3 * 16 / 32 = 1.5 bytes per input byte. */
+                init_string_arena(&ft[file].strings,
+                                  fileInfo[file].size / 32);
+        }
+        parallel_for(numThreads, fileCnt, 1, lex_files_worker, ft);
+        for (File file = 0; file < fileCnt; file++) {
+                merge_file_tokens(file, &ft[file]);
+                BUF_EXIT(ft[file].kind, ft[file].kindAlloc);
+                BUF_EXIT(ft[file].value, ft[file].valueAlloc);
+                BUF_EXIT(ft[file].offset, ft[file].offsetAlloc);
+                BUF_EXIT(ft[file].literal, ft[file].literalAlloc);
+                exit_string_arena(&ft[file].strings);
+        }
+        BUF_EXIT(ft, ftAlloc);
 }
 
 Token look_next_token(void)
 {
-        if (haveSavedToken)
-                return savedToken;
-        else {
-                savedToken = parse_next_token();
-                haveSavedToken = 1;
-                return savedToken;
+        Token end = fileInfo[currentFile].firstToken +
+                    fileInfo[currentFile].numTokens;
+        if (currentToken == end)
+                return -1;
+        return currentToken;
+}
+
+Token parse_next_token(void)
+{
+        Token tok = look_next_token();
+        if (tok != -1) {
+                currentToken++;
+                currentOffset = tokenLocation[tok].offset;
         }
+        return tok;
+}
+
+/* Fails at the end of the current file, where something was expected */
+static void NORETURN unexpected_end_of_file(const char *expected)
+{
+        FATAL_PARSE_ERROR_AT(currentFile, fileInfo[currentFile].size,
+                             "Unexpected end of file. Expected %s\n",
+                             expected);
 }
 
 Token parse_token_kind(int tkind)
 {
         Token tok = parse_next_token();
         if (tok == -1) {
-                FATAL_PARSE_ERROR_AT(currentFile, currentOffset,
+                FATAL_PARSE_ERROR_AT(currentFile, fileInfo[currentFile].size,
                                "Unexpected end of file. Expected %s token\n",
                                tokenKindString[tkind]);
         }
-        int k = tokenInfo[tok].kind;
+        int k = tokenKind[tok];
         if (k != tkind) {
                 FATAL_PARSE_ERROR(tok, "Expected %s token\n",
                                   tokenKindString[tkind]);
@@ -826,7 +1002,7 @@ Token parse_token_kind(int tkind)
 Token look_token_kind(int tkind)
 {
         Token tok = look_next_token();
-        if (tok == -1 || tokenInfo[tok].kind != tkind)
+        if (tok == -1 || tokenKind[tok] != tkind)
                 return -1;
         return tok;
 }
@@ -835,7 +1011,7 @@ String parse_name(void)
 {
         PARSE_LOG();
         Token tok = parse_token_kind(TOKTYPE_WORD);
-        return tokenInfo[tok].tWord.string;
+        return tokenValue[tok].string;
 }
 
 Symref parse_symref(void)
@@ -919,20 +1095,22 @@ Expr parse_expr(int minprec)
 
         PARSE_LOG();
         tok = look_next_token();
+        if (tok == -1)
+                unexpected_end_of_file("expression");
         if (token_is_unary_prefix_operator(tok, &opkind)) {
                 parse_next_token();
                 subexpr = parse_expr(42  /* TODO: unop precedence */);
                 expr = add_unop_expr(opkind, tok, subexpr);
         }
-        else if (tokenInfo[tok].kind == TOKTYPE_WORD) {
+        else if (tokenKind[tok] == TOKTYPE_WORD) {
                 Symref ref = parse_symref();
                 expr = add_symref_expr(ref);
         }
-        else if (tokenInfo[tok].kind == TOKTYPE_INTEGER) {
+        else if (tokenKind[tok] == TOKTYPE_INTEGER) {
                 parse_next_token();
                 expr = add_literal_expr(tok);
         }
-        else if (tokenInfo[tok].kind == TOKTYPE_LEFTPAREN) {
+        else if (tokenKind[tok] == TOKTYPE_LEFTPAREN) {
                 parse_next_token();
                 expr = parse_expr(0);
                 parse_token_kind(TOKTYPE_RIGHTPAREN);
@@ -943,29 +1121,36 @@ Expr parse_expr(int minprec)
 
         for (;;) {
                 tok = look_next_token();
+                if (tok == -1)
+                        break;  // let the caller report what is missing
                 if (token_is_unary_postfix_operator(tok, &opkind)) {
                         parse_next_token();
                         expr = add_unop_expr(opkind, tok, expr);
                 }
-                else if (tokenInfo[tok].kind == TOKTYPE_LEFTPAREN) {
+                else if (tokenKind[tok] == TOKTYPE_LEFTPAREN) {
                         parse_next_token();
-                        expr = add_call_expr(expr);
+                        int stackStart = callArgStackCnt;
+                        Expr callee = expr;
                         while (look_token_kind(TOKTYPE_RIGHTPAREN) == -1) {
                                 subexpr = parse_expr(0);
-                                add_CallArg(expr, subexpr);
+                                push_CallArg(subexpr);
                                 if (look_token_kind(TOKTYPE_COMMA) == -1)
                                         break;
                                 parse_next_token();
                         }
                         parse_token_kind(TOKTYPE_RIGHTPAREN);
+                        /* added after the args, like all parent
+                         * expressions are added after their children */
+                        expr = add_call_expr(callee);
+                        commit_CallArgs(expr, stackStart);
                 }
-                else if (tokenInfo[tok].kind == TOKTYPE_DOT) {
+                else if (tokenKind[tok] == TOKTYPE_DOT) {
                         parse_next_token();
                         Token x = parse_token_kind(TOKTYPE_WORD);
-                        String name = tokenInfo[x].tWord.string;
+                        String name = tokenValue[x].string;
                         expr = add_member_expr(expr, name);
                 }
-                else if (tokenInfo[tok].kind == TOKTYPE_LEFTBRACKET) {
+                else if (tokenKind[tok] == TOKTYPE_LEFTBRACKET) {
                         parse_next_token();
                         subexpr = parse_expr(0);
                         parse_token_kind(TOKTYPE_RIGHTBRACKET);
@@ -1015,15 +1200,17 @@ Stmt parse_compound_stmt(void)
 {
         Stmt stmt;
         Stmt substmt;
+        int stackStart = childStmtStackCnt;
 
         PARSE_LOG();
         stmt = add_compound_stmt();
         parse_token_kind(TOKTYPE_LEFTBRACE);
         while (look_token_kind(TOKTYPE_RIGHTBRACE) == -1) {
                 substmt = parse_stmt();
-                add_ChildStmt(stmt, substmt);
+                push_ChildStmt(substmt);
         }
         parse_token_kind(TOKTYPE_RIGHTBRACE);
+        commit_ChildStmts(stmt, stackStart);
         return stmt;
 }
 
@@ -1031,7 +1218,7 @@ Stmt parse_expr_or_compound_stmt(void)
 {
         PARSE_LOG();
         Token tok = look_next_token();
-        if (tokenInfo[tok].kind == TOKTYPE_LEFTBRACE)
+        if (tok != -1 && tokenKind[tok] == TOKTYPE_LEFTBRACE)
                 return parse_compound_stmt();
         else
                 return parse_expr_stmt();
@@ -1096,37 +1283,28 @@ Stmt parse_stmt(void)
 
         PARSE_LOG();
         tok = look_next_token();
-        if (tokenInfo[tok].kind == TOKTYPE_WORD) {
-                String s = tokenInfo[tok].tWord.string;
-                if (s == constStr[CONSTSTR_DATA]) {
-                        parse_next_token();
-                        return parse_data_stmt();
-                }
-                else if (s == constStr[CONSTSTR_ARRAY]) {
-                        parse_next_token();
-                        return parse_array_stmt();
-                }
-                else if (s == constStr[CONSTSTR_IF]) {
-                        parse_next_token();
-                        return parse_if_stmt();
-                }
-                else if (s == constStr[CONSTSTR_WHILE]) {
-                        parse_next_token();
-                        return parse_while_stmt();
-                }
-                else if (s == constStr[CONSTSTR_FOR]) {
-                        parse_next_token();
-                        return parse_for_stmt();
-                }
-                else if (s == constStr[CONSTSTR_RETURN]) {
-                        parse_next_token();
-                        return parse_return_stmt();
-                }
-                else {
-                        return parse_expr_stmt();
-                }
-        }
-        else {
+        if (tok == -1)
+                unexpected_end_of_file("statement");
+        switch (tokenKind[tok]) {
+        case TOKTYPE_DATA:
+                parse_next_token();
+                return parse_data_stmt();
+        case TOKTYPE_ARRAY:
+                parse_next_token();
+                return parse_array_stmt();
+        case TOKTYPE_IF:
+                parse_next_token();
+                return parse_if_stmt();
+        case TOKTYPE_WHILE:
+                parse_next_token();
+                return parse_while_stmt();
+        case TOKTYPE_FOR:
+                parse_next_token();
+                return parse_for_stmt();
+        case TOKTYPE_RETURN:
+                parse_next_token();
+                return parse_return_stmt();
+        default:
                 return parse_expr_stmt();
         }
 }
@@ -1146,6 +1324,7 @@ void parse_proc(void)
         name = parse_name();
         pscope = add_proc_scope(currentScope);
         proc = add_proc(rettp, pscope);
+        procInfo[proc].firstExpr = exprCnt;
         psym = add_proc_symbol(name, currentScope, proc);
         procInfo[proc].sym = psym;
         scopeInfo[pscope].tProc.proc = proc;
@@ -1159,13 +1338,16 @@ void parse_proc(void)
                 Type paramtp;
 
                 tok = look_next_token();
-                if (tokenInfo[tok].kind == TOKTYPE_RIGHTPAREN)
+                if (tok != -1 && tokenKind[tok] == TOKTYPE_RIGHTPAREN)
                         break;
                 paramtp = parse_type();
                 paramname = parse_name();
                 param = add_Param(proc, paramtp);
                 paramsym = add_param_symbol(paramname, pscope, param);
                 paramInfo[param].sym = paramsym;
+                /* Procs don't nest, so the params come out contiguous */
+                if (procInfo[proc].nparams++ == 0)
+                        procInfo[proc].firstParam = param;
                 if (look_token_kind(TOKTYPE_COMMA) == -1)
                         break;
                 parse_next_token();
@@ -1176,69 +1358,86 @@ void parse_proc(void)
         pop_scope();
 }
 
-int compare_Symbol(const void *a, const void *b)
-{
-        const Symbol *x = a;
-        const Symbol *y = b;
-        return symbolInfo[*x].scope - symbolInfo[*y].scope;
-}
-
-int compare_ParamInfo(const void *a, const void *b)
-{
-        const struct ParamInfo *x = a;
-        const struct ParamInfo *y = b;
-        if (x->proc != y->proc)
-                return x->proc - y->proc;
-        return x->rank - y->rank;
-}
-
-int compare_ChildStmtInfo(const void *a, const void *b)
-{
-        const struct ChildStmtInfo *x = a;
-        const struct ChildStmtInfo *y = b;
-        if (x->parent != y->parent)
-                return x->parent - y->parent;
-        return x->rank - y->rank;
-}
-
-int compare_CallArgInfo(const void *a, const void *b)
-{
-        const struct CallArgInfo *x = a;
-        const struct CallArgInfo *y = b;
-        if (x->callExpr != y->callExpr)
-                return x->callExpr - y->callExpr;
-        return x->rank - y->rank;
+static inline unsigned hash_symbol_key(Scope scope, String name)
+{
+        unsigned long long h = (unsigned long long) scope << 32 |
+                               (unsigned) name;
+        h *= 0x9E3779B97F4A7C15ull;
+        return (unsigned) (h >> 32);
+}
+
+/* Builds the (scope, name) hash table. Must be called after the symbols got
+ * their final names. If a scope declares a name more than once, the first
+ * (lowest) symbol wins, just like with a linear scan of the scope. The load
+ * factor is kept below 50%. */
+void index_symbols(void)
+{
+        unsigned mask;
+        unsigned bck;
+
+        symBucketCnt = 64;
+        while (symBucketCnt < 2 * symbolCnt)
+                symBucketCnt *= 2;
+        BUF_RESERVE(symBucketInfo, symBucketInfoAlloc, symBucketCnt);
+        for (int i = 0; i < symBucketCnt; i++)
+                symBucketInfo[i].symbol = -1;
+        mask = symBucketCnt - 1;
+        for (Symbol x = 0; x < symbolCnt; x++) {
+                Scope scope = symbolInfo[x].scope;
+                String name = symbolInfo[x].name;
+                for (bck = hash_symbol_key(scope, name) & mask;
+                     symBucketInfo[bck].symbol != -1;
+                     bck = (bck + 1) & mask) {
+                        if (symBucketInfo[bck].scope == scope &&
+                            symBucketInfo[bck].name == name)
+                                break;
+                }
+                if (symBucketInfo[bck].symbol == -1) {
+                        symBucketInfo[bck].scope = scope;
+                        symBucketInfo[bck].name = name;
+                        symBucketInfo[bck].symbol = x;
+                }
+        }
 }
 
 void parse_global_scope(void)
 {
         Token tok;
-        String s;
 
         PARSE_LOG();
         globalScope = add_global_scope();
         push_scope(globalScope);
-        for (;;) {
-                tok = look_next_token();
-                if (tok == -1)
-                        break;
-                parse_token_kind(TOKTYPE_WORD);
-                s = tokenInfo[tok].tWord.string;
-                if (s == constStr[CONSTSTR_ENTITY]) {
-                        parse_entity();
-                }
-                else if (s == constStr[CONSTSTR_ARRAY]) {
-                        parse_array();
-                }
-                else if (s == constStr[CONSTSTR_DATA]) {
-                        parse_data();
-                }
-                else if (s == constStr[CONSTSTR_PROC]) {
-                        parse_proc();
-                }
-                else {
-                        FATAL_PARSE_ERROR(tok,
-                            "Unexpected word %s\n", TS(tok));
+        for (File file = 0; file < fileCnt; file++) {
+                currentFile = file;
+                currentToken = fileInfo[file].firstToken;
+                for (;;) {
+                        tok = look_next_token();
+                        if (tok == -1)
+                                break;
+                        switch (tokenKind[tok]) {
+                        case TOKTYPE_ENTITY:
+                                parse_next_token();
+                                parse_entity();
+                                break;
+                        case TOKTYPE_ARRAY:
+                                parse_next_token();
+                                parse_array();
+                                break;
+                        case TOKTYPE_DATA:
+                                parse_next_token();
+                                parse_data();
+                                break;
+                        case TOKTYPE_PROC:
+                                parse_next_token();
+                                parse_proc();
+                                break;
+                        case TOKTYPE_WORD:
+                                FATAL_PARSE_ERROR(tok,
+                                    "Unexpected word %s\n", TS(tok));
+                        default:
+                                FATAL_PARSE_ERROR(tok,
+                                    "Expected a declaration\n");
+                        }
                 }
         }
 
@@ -1251,20 +1450,23 @@ void parse_global_scope(void)
         {
                 /* permute Symbol array so they are grouped by defining scope */
                 /* TODO: this kind of renaming should be abstracted */
-                Symbol *order;
+                /* A stable counting sort by scope gives the new names */
                 Symbol *newname;
-                struct Alloc orderAlloc;
+                int *scopeStart;
                 struct Alloc newnameAlloc;
-                BUF_INIT(order, orderAlloc);
+                struct Alloc scopeStartAlloc;
                 BUF_INIT(newname, newnameAlloc);
-                BUF_RESERVE(order, orderAlloc, symbolCnt);
+                BUF_INIT(scopeStart, scopeStartAlloc);
                 BUF_RESERVE(newname, newnameAlloc, symbolCnt);
+                BUF_RESERVE(scopeStart, scopeStartAlloc, scopeCnt + 1);
+                for (Scope i = 0; i <= scopeCnt; i++)
+                        scopeStart[i] = 0;
                 for (Symbol i = 0; i < symbolCnt; i++)
-                        order[i] = i;
-                sort_array(order, symbolCnt, sizeof *order,
-                           compare_Symbol);
+                        scopeStart[symbolInfo[i].scope + 1]++;
+                for (Scope i = 0; i < scopeCnt; i++)
+                        scopeStart[i + 1] += scopeStart[i];
                 for (Symbol i = 0; i < symbolCnt; i++)
-                        newname[order[i]] = i;
+                        newname[i] = scopeStart[symbolInfo[i].scope]++;
                 for (Data i = 0; i < dataCnt; i++)
                         dataInfo[i].sym = newname[dataInfo[i].sym];
                 for (Array i = 0; i < arrayCnt; i++)
@@ -1284,106 +1486,100 @@ void parse_global_scope(void)
                                 j = next;
                         }
                 }
-                BUF_EXIT(order, orderAlloc);
                 BUF_EXIT(newname, newnameAlloc);
-        }
-
-        /* sort paramInfo array and fix symbols */
-        sort_array(paramInfo, paramCnt, sizeof *paramInfo,
-                   compare_ParamInfo);
-        for (Param i = 0; i < paramCnt; i++)
-                symbolInfo[paramInfo[i].sym].tParam = i;
-
-        sort_array(childStmtInfo, childStmtCnt, sizeof *childStmtInfo,
-                   compare_ChildStmtInfo);
-        sort_array(callArgInfo, callArgCnt, sizeof *callArgInfo,
-                   compare_CallArgInfo);
-
-        for (Param param = paramCnt; param --> 0;) {
-                Proc proc = paramInfo[param].proc;
-                procInfo[proc].nparams++;
-                procInfo[proc].firstParam = param;
-        }
-
-        for (int i = childStmtCnt; i --> 0;) {
-                Stmt parent = childStmtInfo[i].parent;
-                assert(stmtInfo[parent].kind == STMT_COMPOUND);
-                stmtInfo[parent].tCompound.numStatements++;
-                stmtInfo[parent].tCompound.firstChildStmtIdx = i;
-        }
-
-        for (int i = callArgCnt; i --> 0;) {
-                Expr callee = callArgInfo[i].callExpr;
-                assert(exprInfo[callee].kind == EXPR_CALL);
-                exprInfo[callee].tCall.nargs++;
-                exprInfo[callee].tCall.firstArgIdx = i;
+                BUF_EXIT(scopeStart, scopeStartAlloc);
         }
 
         for (Symbol i = symbolCnt; i --> 0;) {
                 scopeInfo[symbolInfo[i].scope].numSymbols++;
                 scopeInfo[symbolInfo[i].scope].firstSymbol = i;
         }
+
+        index_symbols();
 }
 
 Symbol find_symbol_in_scope(String name, Scope scope)
 {
+        unsigned mask = symBucketCnt - 1;
+        unsigned bck;
+
         //MSG("RESOLVE %s\n", string_buffer(name));
         for (; scope != -1; scope = scopeInfo[scope].parentScope) {
-                Symbol first = scopeInfo[scope].firstSymbol;
-                Symbol last = first + scopeInfo[scope].numSymbols;
-                for (Symbol i = first; i < last; i++) {
-                        if (symbolInfo[i].name == name) {
+                for (bck = hash_symbol_key(scope, name) & mask;
+                     symBucketInfo[bck].symbol != -1;
+                     bck = (bck + 1) & mask) {
+                        if (symBucketInfo[bck].scope == scope &&
+                            symBucketInfo[bck].name == name) {
                                 //MSG("FOUND symbol %s\n", string_buffer(name));
-                                return i;
+                                return symBucketInfo[bck].symbol;
                         }
                 }
         }
         return -1;
 }
 
-void resolve_symbol_references(void)
+static void resolve_symrefs_worker(UNUSED void *arg, int first, int last)
 {
-        for (Symref ref = 0; ref < symrefCnt; ref++) {
+        for (Symref ref = first; ref < last; ref++) {
                 String name = symrefInfo[ref].name;
                 Scope refScope = symrefInfo[ref].refScope;
-                Symbol sym = find_symbol_in_scope(name, refScope);
-                if (sym < 0) {
+                symrefInfo[ref].sym = find_symbol_in_scope(name, refScope);
+        }
+}
+
+/* The lookups only read the scope and symbol tables, so they are done in
+ * parallel if numThreads > 1. Unresolved references are reported afterwards,
+ * in ref order, so the output doesn't depend on the number of threads. */
+void resolve_symbol_references(void)
+{
+        parallel_for(numThreads, symrefCnt, 4096, resolve_symrefs_worker, NULL);
+        for (Symref ref = 0; ref < symrefCnt; ref++) {
+                if (symrefInfo[ref].sym < 0) {
                         MSG_AT_TOK("ERROR", symrefInfo[ref].tok,
                                    "unresolved symbol reference %s\n",
-                                   string_buffer(name));
+                                   string_buffer(symrefInfo[ref].name));
                 }
-                symrefInfo[ref].sym = sym;
         }
 }
 
-void resolve_ref_type(Type t)
+/* Returns the i-th type that t refers to, or -1 if there are no more. Proc
+ * types are not followed since they are always incomplete for now. */
+static Type type_dependency(Type t, int i)
 {
-        if (typeInfo[t].isComplete >= 0) {
-                /* already processed */
-                return;
+        switch (typeInfo[t].kind) {
+        case TYPE_ENTITY:
+                return i == 0 ? typeInfo[t].tEntity.tp : -1;
+        case TYPE_ARRAY:
+                if (i == 0)
+                        return typeInfo[t].tArray.idxtp;
+                if (i == 1)
+                        return typeInfo[t].tArray.valuetp;
+                return -1;
+        case TYPE_REFERENCE: {
+                Symbol sym = symrefInfo[typeInfo[t].tRef.ref].sym;
+                if (i == 0 && sym != -1 && symbolInfo[sym].kind == SYMBOL_TYPE)
+                        return symbolInfo[sym].tType;
+                return -1;
         }
-        if (typeInfo[t].isComplete == -1) {
-                WARN("Type #%d: cyclic type reference\n", t);
-                typeInfo[t].isComplete = 0;
-                return;
+        default:
+                return -1;
         }
+}
 
-        const int unassigned = -42;
-
-        int isComplete = unassigned;
-        Type resolvedTp = -1;
+/* Sets isComplete (and resolvedTp) of a type whose dependencies are done and
+ * which is not part of a cycle */
+static void resolve_type(Type t)
+{
+        int isComplete;
 
         switch (typeInfo[t].kind) {
         case TYPE_BASE:
                 isComplete = 1;
                 break;
         case TYPE_ENTITY:
-                resolve_ref_type(typeInfo[t].tEntity.tp);
                 isComplete = typeInfo[typeInfo[t].tEntity.tp].isComplete;
                 break;
         case TYPE_ARRAY:
-                resolve_ref_type(typeInfo[t].tArray.idxtp);
-                resolve_ref_type(typeInfo[t].tArray.valuetp);
                 isComplete =
                         typeInfo[typeInfo[t].tArray.idxtp].isComplete &&
                         typeInfo[typeInfo[t].tArray.valuetp].isComplete;
@@ -1393,43 +1589,237 @@ void resolve_ref_type(Type t)
                 // TODO
                 break;
         case TYPE_REFERENCE: {
-                typeInfo[t].isComplete = -1;
-                Symbol sym = symrefInfo[typeInfo[t].tRef.ref].sym;
-                isComplete = 0;
-                if (sym != -1 && symbolInfo[sym].kind == SYMBOL_TYPE) {
-                        Type symtp = symbolInfo[sym].tType;
-                        if (symtp != -1) {
-                                resolve_ref_type(symtp);
-                                isComplete = typeInfo[symtp].isComplete;
-                                resolvedTp = symtp;
-                        }
-                }
+                Type symtp = type_dependency(t, 0);
+                isComplete = symtp != -1 && typeInfo[symtp].isComplete;
+                typeInfo[t].tRef.resolvedTp = symtp;
                 break;
         }
         default:
                 UNHANDLED_CASE();
         }
-        assert(isComplete != unassigned);
         typeInfo[t].isComplete = isComplete;
-        typeInfo[t].tRef.resolvedTp = resolvedTp;
 }
 
+/* Canonical types. Base and entity types are told apart by name, so each
+ * is its own canonical type. A complete type reference has the canonical type
+ * of the type it refers to. All array (or proc) types whose components have
+ * the same canonical types share one canonical type, which is the first such
+ * type that was found. Incomplete types are only equal to themselves. After
+ * this, complete types are equal iff their canonical types are equal. */
+
+static inline unsigned long long hash_type_step(unsigned long long h, Type t)
+{
+        return (h ^ (unsigned) t) * 0x9E3779B97F4A7C15ull;
+}
+
+/* Compares two array or proc types whose components are canonicalized */
+static int same_type_structure(Type a, Type b)
+{
+        if (typeInfo[a].kind != typeInfo[b].kind)
+                return 0;
+        if (typeInfo[a].kind == TYPE_ARRAY)
+                return typeCanon[typeInfo[a].tArray.idxtp] ==
+                       typeCanon[typeInfo[b].tArray.idxtp] &&
+                       typeCanon[typeInfo[a].tArray.valuetp] ==
+                       typeCanon[typeInfo[b].tArray.valuetp];
+        int nargs = typeInfo[a].tProc.nargs;
+        int firstA = typeInfo[a].tProc.firstParamtype;
+        int firstB = typeInfo[b].tProc.firstParamtype;
+        if (typeCanon[typeInfo[a].tProc.rettp] !=
+            typeCanon[typeInfo[b].tProc.rettp])
+                return 0;
+        if (nargs != typeInfo[b].tProc.nargs)
+                return 0;
+        for (int i = 0; i < nargs; i++)
+                if (typeCanon[paramtypeInfo[firstA + i].argtp] !=
+                    typeCanon[paramtypeInfo[firstB + i].argtp])
+                        return 0;
+        return 1;
+}
+
+/* The components of t must be canonicalized already. bucket is an
+ * open-addressing table of the canonical array and proc types. */
+static Type canonical_type(Type t, Type *bucket, unsigned mask)
+{
+        unsigned long long h = 0;
+        unsigned bck;
+        Type c;
+
+        if (!typeInfo[t].isComplete)
+                return t;
+        switch (typeInfo[t].kind) {
+        case TYPE_BASE:
+        case TYPE_ENTITY:
+                return t;
+        case TYPE_REFERENCE:
+                return typeCanon[typeInfo[t].tRef.resolvedTp];
+        case TYPE_ARRAY:
+                h = hash_type_step(TYPE_ARRAY,
+                                   typeCanon[typeInfo[t].tArray.idxtp]);
+                h = hash_type_step(h, typeCanon[typeInfo[t].tArray.valuetp]);
+                break;
+        case TYPE_PROC: {
+                int first = typeInfo[t].tProc.firstParamtype;
+                int nargs = typeInfo[t].tProc.nargs;
+                h = hash_type_step(TYPE_PROC, typeCanon[typeInfo[t].tProc.rettp]);
+                for (int i = 0; i < nargs; i++)
+                        h = hash_type_step(h,
+                                typeCanon[paramtypeInfo[first + i].argtp]);
+                break;
+        }
+        default:
+                UNHANDLED_CASE();
+        }
+        for (bck = (unsigned) (h >> 32) & mask;
+             (c = bucket[bck]) != -1;
+             bck = (bck + 1) & mask) {
+                if (same_type_structure(c, t))
+                        return c;
+        }
+        bucket[bck] = t;
+        return t;
+}
+
+/* order lists all types such that each type comes after its components */
+void canonicalize_types(const Type *order)
+{
+        Type *bucket;
+        struct Alloc bucketAlloc;
+        int bucketCnt = 64;
+
+        while (bucketCnt < 2 * typeCnt)
+                bucketCnt *= 2;
+        BUF_INIT(bucket, bucketAlloc);
+        BUF_RESERVE(bucket, bucketAlloc, bucketCnt);
+        for (int i = 0; i < bucketCnt; i++)
+                bucket[i] = -1;
+        BUF_RESERVE(typeCanon, typeCanonAlloc, typeCnt);
+        for (int i = 0; i < typeCnt; i++) {
+                Type t = order[i];
+                typeCanon[t] = canonical_type(t, bucket, bucketCnt - 1);
+        }
+        BUF_EXIT(bucket, bucketAlloc);
+}
+
+/* Finds the strongly connected components of the graph of type dependencies
+ * with Tarjan's algorithm. The depth-first search uses an explicit stack, so
+ * long chains of types can't overflow the call stack. Tarjan's algorithm
+ * finishes each component after all components that it depends on, so
+ * completeness is decided in dependency order, in linear time. The types of
+ * a component with a cycle are all incomplete, and the cycle is reported
+ * once. */
 void resolve_type_references(void)
 {
-        /* isComplete -2 means "TO DO" */
-        /* isComplete -1 means "currently resolving" */
-        for (Type t = 0; t < typeCnt; t++)
-                typeInfo[t].isComplete = -2;
-        for (Type t = 0; t < typeCnt; t++)
+        int *index;  // DFS visit number, -1 if not visited yet
+        int *lowlink;
+        Type *sccStack;
+        Type *dfsType;
+        int *dfsEdge;  // next dependency to look at
+        Type *order;  // types in the order their components were finished
+        struct Alloc indexAlloc;
+        struct Alloc lowlinkAlloc;
+        struct Alloc sccStackAlloc;
+        struct Alloc dfsTypeAlloc;
+        struct Alloc dfsEdgeAlloc;
+        struct Alloc orderAlloc;
+        int sccCnt = 0;
+        int dfsCnt = 0;
+        int orderCnt = 0;
+        int visitCnt = 0;
+
+        BUF_INIT(index, indexAlloc);
+        BUF_INIT(lowlink, lowlinkAlloc);
+        BUF_INIT(sccStack, sccStackAlloc);
+        BUF_INIT(dfsType, dfsTypeAlloc);
+        BUF_INIT(dfsEdge, dfsEdgeAlloc);
+        BUF_INIT(order, orderAlloc);
+        BUF_RESERVE(index, indexAlloc, typeCnt);
+        BUF_RESERVE(lowlink, lowlinkAlloc, typeCnt);
+        BUF_RESERVE(sccStack, sccStackAlloc, typeCnt);
+        BUF_RESERVE(dfsType, dfsTypeAlloc, typeCnt);
+        BUF_RESERVE(dfsEdge, dfsEdgeAlloc, typeCnt);
+        BUF_RESERVE(order, orderAlloc, typeCnt);
+
+        /* isComplete -1 means "not finished", i.e. unvisited or on the
+         * stack of the current component candidates */
+        for (Type t = 0; t < typeCnt; t++) {
+                index[t] = -1;
+                typeInfo[t].isComplete = -1;
                 if (typeInfo[t].kind == TYPE_REFERENCE)
                         typeInfo[t].tRef.resolvedTp = -1;
-        for (Type t = 0; t < typeCnt; t++)
-                if (typeInfo[t].isComplete == -2)
-                        resolve_ref_type(t);
-        for (Type t = 0; t < typeCnt; t++) {
-                assert(typeInfo[t].isComplete == 1 ||
-                       typeInfo[t].isComplete == 0);
         }
+
+        for (Type root = 0; root < typeCnt; root++) {
+                if (index[root] != -1)
+                        continue;
+                index[root] = lowlink[root] = visitCnt++;
+                sccStack[sccCnt++] = root;
+                dfsType[dfsCnt] = root;
+                dfsEdge[dfsCnt] = 0;
+                dfsCnt++;
+                while (dfsCnt > 0) {
+                        Type t = dfsType[dfsCnt - 1];
+                        Type u = type_dependency(t, dfsEdge[dfsCnt - 1]++);
+                        if (u != -1) {
+                                if (index[u] == -1) {
+                                        index[u] = lowlink[u] = visitCnt++;
+                                        sccStack[sccCnt++] = u;
+                                        dfsType[dfsCnt] = u;
+                                        dfsEdge[dfsCnt] = 0;
+                                        dfsCnt++;
+                                }
+                                else if (typeInfo[u].isComplete == -1 &&
+                                         index[u] < lowlink[t])
+                                        lowlink[t] = index[u];
+                                continue;
+                        }
+                        dfsCnt--;
+                        if (dfsCnt > 0) {
+                                Type p = dfsType[dfsCnt - 1];
+                                if (lowlink[t] < lowlink[p])
+                                        lowlink[p] = lowlink[t];
+                        }
+                        if (lowlink[t] != index[t])
+                                continue;
+                        /* t is the root of a component */
+                        int first = sccCnt;
+                        do
+                                first--;
+                        while (sccStack[first] != t);
+                        int isCyclic = first < sccCnt - 1;
+                        for (int i = 0; !isCyclic; i++) {
+                                Type v = type_dependency(t, i);
+                                if (v == -1)
+                                        break;
+                                isCyclic = v == t;
+                        }
+                        if (isCyclic) {
+                                WARN("Type #%d: cyclic type reference\n", t);
+                                for (int i = first; i < sccCnt; i++) {
+                                        Type v = sccStack[i];
+                                        if (typeInfo[v].kind == TYPE_REFERENCE)
+                                                typeInfo[v].tRef.resolvedTp =
+                                                        type_dependency(v, 0);
+                                        typeInfo[v].isComplete = 0;
+                                }
+                        }
+                        else
+                                resolve_type(t);
+                        for (int i = first; i < sccCnt; i++)
+                                order[orderCnt++] = sccStack[i];
+                        sccCnt = first;
+                }
+        }
+        assert(orderCnt == typeCnt);
+
+        canonicalize_types(order);
+
+        BUF_EXIT(index, indexAlloc);
+        BUF_EXIT(lowlink, lowlinkAlloc);
+        BUF_EXIT(sccStack, sccStackAlloc);
+        BUF_EXIT(dfsType, dfsTypeAlloc);
+        BUF_EXIT(dfsEdge, dfsEdgeAlloc);
+        BUF_EXIT(order, orderAlloc);
 }
 
 int is_integral_type(Type t)
@@ -1449,22 +1839,14 @@ int type_equal(Type a, Type b)
                 return 0;
         if (!typeInfo[b].isComplete)
                 return 0;
-        while (typeInfo[a].kind == TYPE_REFERENCE) {
-                a = typeInfo[a].tRef.resolvedTp;
-                assert(a != -1);
-        }
-        while (typeInfo[b].kind == TYPE_REFERENCE) {
-                b = typeInfo[b].tRef.resolvedTp;
-                assert(a != -1);
-        }
-        return a == b;
+        return typeCanon[a] == typeCanon[b];
 }
 
 Type check_literal_expr_type(Expr x)
 {
         //XXX
         Type tp = 0;
-        exprInfo[x].tp = tp;
+        exprType[x] = tp;
         return tp;
 }
 
@@ -1502,18 +1884,19 @@ Type check_symref_expr_type(Expr x)
                         UNHANDLED_CASE();
                         break;
         }
+        /* Expression types are always canonical */
+        if (tp != -1)
+                tp = typeCanon[tp];
 out:
-        exprInfo[x].tp = tp;
+        exprType[x] = tp;
         return tp;
 }
 
-Type check_expr_type(Expr x);
-
 Type check_unop_expr_type(Expr x)
 {
-        int op = exprInfo[x].tUnop.kind;
+        int op = exprInfo[x].opkind;
         Expr xx = exprInfo[x].tUnop.expr;
-        Type tt = check_expr_type(xx);
+        Type tt = exprType[xx];
         Type tp = -1;
         if (tt != -1) {
                 switch (op) {
@@ -1534,17 +1917,17 @@ Type check_unop_expr_type(Expr x)
                         UNHANDLED_CASE();
                 }
         }
-        exprInfo[x].tp = tp;
+        exprType[x] = tp;
         return tp;
 }
 
 Type check_binop_expr_type(Expr x)
 {
-        int op = exprInfo[x].tUnop.kind;
+        int op = exprInfo[x].opkind;
         Expr x1 = exprInfo[x].tBinop.expr1;
         Expr x2 = exprInfo[x].tBinop.expr2;
-        Type t1 = check_expr_type(x1);
-        Type t2 = check_expr_type(x2);
+        Type t1 = exprType[x1];
+        Type t2 = exprType[x2];
         Type tp = -1;
         if (t1 != -1 && t2 != -1) {
                 switch (op) {
@@ -1565,7 +1948,7 @@ Type check_binop_expr_type(Expr x)
                         UNHANDLED_CASE();
                 }
         }
-        exprInfo[x].tp = tp;
+        exprType[x] = tp;
         return tp;
 }
 
@@ -1576,7 +1959,7 @@ Type check_member_expr_type(Expr x)
         Type tt = exprInfo[xx].tMember.expr;
         // TODO: lookup member and infer type
         Type tp = -1;
-        exprInfo[x].tp = tp;
+        exprType[x] = tp;
         return tp;
 }
 
@@ -1584,8 +1967,8 @@ Type check_subscript_expr_type(Expr x)
 {
         Expr x1 = exprInfo[x].tSubscript.expr1;
         Expr x2 = exprInfo[x].tSubscript.expr2;
-        Type t1 = check_expr_type(x1);
-        Type t2 = check_expr_type(x2);
+        Type t1 = exprType[x1];
+        Type t2 = exprType[x2];
         Type tp = -1;
 
         if (is_bad_type(t1) || is_bad_type(t2)) {
@@ -1602,12 +1985,12 @@ Type check_subscript_expr_type(Expr x)
                             "Incompatible type of index "
                             "in subscript expression\n");
         else
-                tp = typeInfo[t1].tArray.valuetp;
+                tp = typeCanon[typeInfo[t1].tArray.valuetp];
         /*
         MSG("t1=%d, t2=%d, idxtp=%d, valuetp=%d, tp=%d\n",
             t1, t2, typeInfo[t1].tArray.idxtp, typeInfo[t1].tArray.valuetp, tp);
             */
-        exprInfo[x].tp = tp;
+        exprType[x] = tp;
         return tp;
 }
 
@@ -1615,7 +1998,7 @@ Type check_call_expr_type(Expr x)
 {
         //XXX total mess and incomplete and wrong
         Expr callee = exprInfo[x].tCall.callee;
-        Type calleeTp = check_expr_type(callee);
+        Type calleeTp = exprType[callee];
         if (calleeTp == -1)
                 return -1;
         int calleeTpKind = typeInfo[calleeTp].kind;
@@ -1623,13 +2006,7 @@ Type check_call_expr_type(Expr x)
                 WARN_PARSE_ERROR_EXPR(callee,
                     "Called expression: Expected proc type but found %s\n",
                     typeKindString[calleeTpKind]);
-        int first = exprInfo[x].tCall.firstArgIdx;
-        int last = first + exprInfo[x].tCall.nargs;
-        for (int i = first; i < last; i++) {
-                Expr argx = callArgInfo[i].argExpr;
-                check_expr_type(argx);
-                // TODO: check that argument type matches param of called proc
-        }
+        // TODO: check that argument types match params of called proc
         return -1;
 }
 
@@ -1661,16 +2038,65 @@ Type check_expr_type(Expr x)
         default:
                 UNHANDLED_CASE();
         }
-        exprInfo[x].tp = tp;
+        exprType[x] = tp;
         return tp;
 }
 
+struct CheckTypes {
+        struct MessageBuffer *messages;  // one per proc
+};
+
+/* The expressions of a proc's body range from its firstExpr to the next
+ * proc's. Any expressions outside of procs go with the first or last one. */
+static void check_types_worker(void *arg, int first, int last)
+{
+        struct CheckTypes *ct = arg;
+        for (Proc p = first; p < last; p++) {
+                Expr begin = p == 0 ? 0 : procInfo[p].firstExpr;
+                Expr end = p + 1 == procCnt ? exprCnt : procInfo[p+1].firstExpr;
+                set_message_buffer(&ct->messages[p]);
+                for (Expr x = begin; x < end; x++)
+                        check_expr_type(x);
+        }
+        set_message_buffer(NULL);
+}
+
+/* Subexpressions are always added before the expressions that contain them.
+ * So a single pass in index order checks every expression exactly once, and
+ * the types of its subexpressions are already in exprType. The procs are
+ * checked in parallel if numThreads > 1. They only read the types and
+ * symbols, and each writes the exprType entries of its own expressions. Each
+ * proc's messages are collected separately and printed in proc order, so the
+ * output is the same as from checking the expressions one after another. */
 void check_types(void)
 {
-        for (Expr x = 0; x < exprCnt; x++)
-                check_expr_type(x);
+        struct CheckTypes ct;
+        struct Alloc messagesAlloc;
+
+        BUF_RESERVE(exprType, exprTypeAlloc, exprCnt);
+        if (procCnt == 0) {
+                for (Expr x = 0; x < exprCnt; x++)
+                        check_expr_type(x);
+        }
+        else {
+                /* Line numbers are computed lazily. Do it beforehand, since
+                 * the workers can't modify the file table. */
+                for (File file = 0; file < fileCnt; file++)
+                        if (fileInfo[file].lineCnt == 0)
+                                index_lines(file);
+                BUF_INIT(ct.messages, messagesAlloc);
+                BUF_RESERVE(ct.messages, messagesAlloc, procCnt);
+                for (Proc p = 0; p < procCnt; p++)
+                        init_message_buffer(&ct.messages[p]);
+                parallel_for(numThreads, procCnt, 16, check_types_worker, &ct);
+                for (Proc p = 0; p < procCnt; p++) {
+                        flush_message_buffer(&ct.messages[p]);
+                        exit_message_buffer(&ct.messages[p]);
+                }
+                BUF_EXIT(ct.messages, messagesAlloc);
+        }
         for (Expr x = 0; x < exprCnt; x++) {
-                if (exprInfo[x].tp == -1)
+                if (exprType[x] == -1)
                         LOG_TYPE_ERROR_EXPR(
                                 x, "Type check of expression failed\n");
         }
@@ -1678,17 +2104,39 @@ void check_types(void)
 
 int main(int argc, const char **argv)
 {
-        init_strings();
-        init_basetypes();
+        struct CompileContext ctx;
+        const char *runName = NULL;
+        int runNative = 0;
 
-        const char *fileToParse = "test.txt";
-        for (int i = 1; i < argc; i++)
+        init_compile_context(&ctx, 1);
+        enter_compile_context(&ctx);
+        for (int i = 1; i < argc; i++) {
                 if (cstr_compare(argv[i], "-debug") == 0)
                         doDebug = 1;
+                else if (argv[i][0] == '-' && argv[i][1] == 'j') {
+                        numThreads = 0;
+                        for (const char *p = argv[i] + 2; *p; p++) {
+                                if (*p < '0' || *p > '9')
+                                        FATAL("Invalid option %s\n", argv[i]);
+                                numThreads = 10 * numThreads + *p - '0';
+                        }
+                        if (numThreads < 1)
+                                FATAL("Invalid option %s\n", argv[i]);
+                }
+                else if (cstr_compare(argv[i], "-run") == 0) {
+                        if (i + 1 == argc)
+                                FATAL("Option -run needs a proc name\n");
+                        runName = argv[++i];
+                }
+                else if (cstr_compare(argv[i], "-native") == 0)
+                        runNative = 1;
                 else
-                        fileToParse = argv[i];
+                        add_file(intern_cstring(argv[i]));
+        }
+        if (fileCnt == 0)
+                add_file(intern_cstring("test.txt"));
 
-        add_file(intern_cstring(fileToParse));
+        lex_all_files();
         parse_global_scope();
         MSG("INFO", "Resolving symbol references...\n");
         resolve_symbol_references();
@@ -1696,7 +2144,24 @@ int main(int argc, const char **argv)
         resolve_type_references();
         MSG("INFO", "Checking types...\n");
         check_types();
-        MSG("INFO", "Pretty printing input...\n\n");
-        prettyprint();
+        if (runName) {
+                Symbol sym = find_symbol_in_scope(intern_cstring(runName),
+                                                  globalScope);
+                if (sym == -1 || symbolInfo[sym].kind != SYMBOL_PROC)
+                        FATAL("No proc named %s\n", runName);
+                MSG("INFO", "Compiling bytecode...\n");
+                compile_bytecode();
+                MSG("INFO", "Running %s...\n", runName);
+                long long result = runNative ?
+                        run_native(symbolInfo[sym].tProc) :
+                        run_proc(symbolInfo[sym].tProc);
+                MSG("INFO", "%s returned %lld\n", runName, result);
+        }
+        else {
+                MSG("INFO", "Pretty printing input...\n\n");
+                prettyprint();
+        }
+        leave_compile_context(&ctx);
+        exit_compile_context(&ctx);
         return 0;
 }
@@ -2,6 +2,39 @@
 #define DATA_IMPL
 #include "api.h"
 
+/* Bytes 0x00 to 0x1F are invalid except for the newline character. The NUL
+ * byte terminating each file buffer is therefore also CHARCLASS_INVALID, which
+ * lets the lexer's scanning loops stop at the end of input without a bounds
+ * check. */
+const unsigned char charClass[256] = {
+#define I CHARCLASS_INVALID
+#define W CHARCLASS_WHITESPACE
+#define A CHARCLASS_ALPHA
+#define D CHARCLASS_DIGIT
+#define O CHARCLASS_OTHER
+        I, I, I, I, I, I, I, I, I, I, W, I, I, I, I, I,  /* 0x00 */
+        I, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,  /* 0x10 */
+        W, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,  /* 0x20 */
+        D, D, D, D, D, D, D, D, D, D, O, O, O, O, O, O,  /* 0x30 */
+        O, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,  /* 0x40 */
+        A, A, A, A, A, A, A, A, A, A, A, O, O, O, O, O,  /* 0x50 */
+        O, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,  /* 0x60 */
+        A, A, A, A, A, A, A, A, A, A, A, O, O, O, O, O,  /* 0x70 */
+        O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,  /* 0x80 */
+        O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,  /* 0x90 */
+        O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,  /* 0xA0 */
+        O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,  /* 0xB0 */
+        O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,  /* 0xC0 */
+        O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,  /* 0xD0 */
+        O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,  /* 0xE0 */
+        O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,  /* 0xF0 */
+#undef I
+#undef W
+#undef A
+#undef D
+#undef O
+};
+
 const char *const tokenKindString[] = {
 #define MAKE(x) [x] = #x
         MAKE( TOKTYPE_WORD ),
@@ -29,7 +62,42 @@ const char *const tokenKindString[] = {
         MAKE( TOKTYPE_BANG ),
         MAKE( TOKTYPE_ASSIGNEQUALS ),
         MAKE( TOKTYPE_DOUBLEEQUALS ),
+        MAKE( TOKTYPE_IF ),
+        MAKE( TOKTYPE_WHILE ),
+        MAKE( TOKTYPE_FOR ),
+        MAKE( TOKTYPE_RETURN ),
+        MAKE( TOKTYPE_PROC ),
+        MAKE( TOKTYPE_DATA ),
+        MAKE( TOKTYPE_ENTITY ),
+        MAKE( TOKTYPE_ARRAY ),
+#undef MAKE
+};
+
+const struct PunctuationInfo punctuationInfo[256] = {
+#define MAKE(c, x) [c] = { 1, x, 0, 0 }
+#define MAKE2(c, x, c2, x2) [c] = { 1, x, c2, x2 }
+        MAKE(  '(', TOKTYPE_LEFTPAREN ),
+        MAKE(  ')', TOKTYPE_RIGHTPAREN ),
+        MAKE(  '{', TOKTYPE_LEFTBRACE ),
+        MAKE(  '}', TOKTYPE_RIGHTBRACE ),
+        MAKE(  '[', TOKTYPE_LEFTBRACKET ),
+        MAKE(  ']', TOKTYPE_RIGHTBRACKET ),
+        MAKE(  '.', TOKTYPE_DOT ),
+        MAKE2( '-', TOKTYPE_MINUS, '-', TOKTYPE_DOUBLEMINUS ),
+        MAKE2( '+', TOKTYPE_PLUS, '+', TOKTYPE_DOUBLEPLUS ),
+        MAKE(  '*', TOKTYPE_ASTERISK ),
+        MAKE(  '/', TOKTYPE_SLASH ),
+        MAKE(  ',', TOKTYPE_COMMA ),
+        MAKE(  ';', TOKTYPE_SEMICOLON ),
+        MAKE(  ':', TOKTYPE_COLON ),
+        MAKE(  '&', TOKTYPE_AMPERSAND ),
+        MAKE(  '|', TOKTYPE_PIPE ),
+        MAKE(  '^', TOKTYPE_CARET ),
+        MAKE(  '~', TOKTYPE_TILDE ),
+        MAKE(  '!', TOKTYPE_BANG ),
+        MAKE2( '=', TOKTYPE_ASSIGNEQUALS, '=', TOKTYPE_DOUBLEEQUALS ),
 #undef MAKE
+#undef MAKE2
 };
 
 const char *const exprKindString[] = {
@@ -112,6 +180,19 @@ const struct BinopInfo binopInfo[NUM_BINOPS] = {
 #undef MAKE
 };
 
+const struct KeywordInfo keywordInfo[16] = {
+#define MAKE(c1, c2, s, x) [KEYWORD_HASH(c1, c2)] = { s, sizeof s - 1, x }
+        MAKE( 'i', 'f', "if",     TOKTYPE_IF     ),
+        MAKE( 'w', 'e', "while",  TOKTYPE_WHILE  ),
+        MAKE( 'f', 'r', "for",    TOKTYPE_FOR    ),
+        MAKE( 'r', 'n', "return", TOKTYPE_RETURN ),
+        MAKE( 'p', 'c', "proc",   TOKTYPE_PROC   ),
+        MAKE( 'd', 'a', "data",   TOKTYPE_DATA   ),
+        MAKE( 'e', 'y', "entity", TOKTYPE_ENTITY ),
+        MAKE( 'a', 'y', "array",  TOKTYPE_ARRAY  ),
+#undef MAKE
+};
+
 const struct StringToBeInterned stringsToBeInterned[NUM_CONSTSTRS] = {
 #define MAKE(x, y) [x] = { x, y }
         MAKE( CONSTSTR_IF,     "if"     ),
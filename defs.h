@@ -13,10 +13,12 @@
 #define UNUSED __pragma(warning(suppress: 4100 4101))
 #define NORETURN __declspec(noreturn)
 #define UNREACHABLE() assert(0);
+#define THREAD_LOCAL __declspec(thread)
 #else
 #define UNUSED __attribute__((unused))
 #define NORETURN __attribute__((noreturn))
 #define UNREACHABLE() __builtin_unreachable()
+#define THREAD_LOCAL _Thread_local
 #endif
 #define NOTIMPLEMENTED() fatal("In %s:%d: %s(): not implemented!", \
                                __FILE__, __LINE__, __func__)
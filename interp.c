@@ -0,0 +1,714 @@
+#include "defs.h"
+#include "api.h"
+
+/* A register-based bytecode for procs, and an interpreter for it.
+ *
+ * All values are 64-bit integers. Each proc invocation gets a frame of
+ * registers: the params come first, then the proc's local data, then the
+ * temporaries of the expressions. Global data live in an array indexed by
+ * Data. Each array (global or local) is backed by one growable buffer of
+ * elements indexed from 0. Elements that were never written read as 0. Local
+ * arrays are not allocated per invocation, so they behave like static arrays
+ * in C.
+ *
+ * Constructs that can't be executed (like unresolved symbols, member
+ * expressions, or calls of things that aren't procs) compile to OP_TRAP
+ * instructions. They fail only if execution actually reaches them. */
+
+enum {
+        TRAP_UNRESOLVED,
+        TRAP_NOT_A_VALUE,
+        TRAP_NOT_AN_LVALUE,
+        TRAP_NOT_AN_ARRAY,
+        TRAP_NOT_A_PROC,
+        TRAP_BAD_ARGCOUNT,
+        TRAP_UNSUPPORTED,
+};
+
+static const char *const trapString[] = {
+        [TRAP_UNRESOLVED] = "unresolved symbol",
+        [TRAP_NOT_A_VALUE] = "symbol has no value",
+        [TRAP_NOT_AN_LVALUE] = "expression can't be assigned to",
+        [TRAP_NOT_AN_ARRAY] = "subscripted expression is not an array",
+        [TRAP_NOT_A_PROC] = "called expression is not a proc",
+        [TRAP_BAD_ARGCOUNT] = "wrong number of arguments",
+        [TRAP_UNSUPPORTED] = "expression not supported by the interpreter",
+};
+
+enum {
+        LVALUE_REG,  // register a
+        LVALUE_GLOBAL,  // global data a
+        LVALUE_ELEM,  // element r[b] of array a
+        LVALUE_BAD,
+};
+
+struct Lvalue {
+        int kind;
+        int a;
+        int b;
+};
+
+struct ProcCompiler {
+        Proc proc;
+        int *dataReg;  // registers of the local data, indexed by Data
+        int nlocals;  // params and local data
+        int top;  // first free temporary register
+        int nregs;
+};
+
+static Instr emit(int op, int a, int b, int c)
+{
+        Instr x = instrCnt++;
+        BUF_RESERVE(instrInfo, instrInfoAlloc, instrCnt);
+        instrInfo[x].op = op;
+        instrInfo[x].a = a;
+        instrInfo[x].b = b;
+        instrInfo[x].c = c;
+        return x;
+}
+
+static int new_temp(struct ProcCompiler *pc)
+{
+        int r = pc->top++;
+        if (pc->nregs < pc->top)
+                pc->nregs = pc->top;
+        return r;
+}
+
+static int emit_trap(struct ProcCompiler *pc, int trap, Expr x)
+{
+        emit(OP_TRAP, trap, x, 0);
+        return new_temp(pc);
+}
+
+/* Symbol of a symref expression, or -1 */
+static Symbol expr_symbol(Expr x)
+{
+        if (exprInfo[x].kind != EXPR_SYMREF)
+                return -1;
+        return symrefInfo[exprInfo[x].tSymref.ref].sym;
+}
+
+static int compile_expr(struct ProcCompiler *pc, Expr x);
+
+static struct Lvalue compile_lvalue(struct ProcCompiler *pc, Expr x)
+{
+        struct Lvalue lv = { LVALUE_BAD, TRAP_NOT_AN_LVALUE, 0 };
+        Symbol sym;
+
+        switch (exprInfo[x].kind) {
+        case EXPR_SYMREF:
+                sym = expr_symbol(x);
+                if (sym == -1) {
+                        lv.a = TRAP_UNRESOLVED;
+                        break;
+                }
+                if (symbolInfo[sym].kind == SYMBOL_PARAM) {
+                        lv.kind = LVALUE_REG;
+                        lv.a = symbolInfo[sym].tParam -
+                               procInfo[pc->proc].firstParam;
+                }
+                else if (symbolInfo[sym].kind == SYMBOL_DATA) {
+                        Data d = symbolInfo[sym].tData;
+                        if (scopeInfo[dataInfo[d].scope].kind == SCOPE_PROC) {
+                                lv.kind = LVALUE_REG;
+                                lv.a = pc->dataReg[d];
+                        }
+                        else {
+                                lv.kind = LVALUE_GLOBAL;
+                                lv.a = d;
+                        }
+                }
+                break;
+        case EXPR_SUBSCRIPT: {
+                Expr x1 = exprInfo[x].tSubscript.expr1;
+                sym = expr_symbol(x1);
+                if (sym == -1 || symbolInfo[sym].kind != SYMBOL_ARRAY) {
+                        lv.a = TRAP_NOT_AN_ARRAY;
+                        break;
+                }
+                lv.kind = LVALUE_ELEM;
+                lv.a = symbolInfo[sym].tArray;
+                lv.b = compile_expr(pc, exprInfo[x].tSubscript.expr2);
+                break;
+        }
+        default:
+                break;
+        }
+        return lv;
+}
+
+static int load_lvalue(struct ProcCompiler *pc, struct Lvalue lv, Expr x)
+{
+        int r;
+
+        switch (lv.kind) {
+        case LVALUE_REG:
+                return lv.a;
+        case LVALUE_GLOBAL:
+                r = new_temp(pc);
+                emit(OP_LOADG, r, lv.a, 0);
+                return r;
+        case LVALUE_ELEM:
+                r = new_temp(pc);
+                emit(OP_LOADA, r, lv.a, lv.b);
+                return r;
+        default:
+                return emit_trap(pc, lv.a, x);
+        }
+}
+
+static void store_lvalue(struct Lvalue lv, int r)
+{
+        switch (lv.kind) {
+        case LVALUE_REG:
+                if (lv.a != r)
+                        emit(OP_MOVE, lv.a, r, 0);
+                break;
+        case LVALUE_GLOBAL:
+                emit(OP_STOREG, lv.a, r, 0);
+                break;
+        case LVALUE_ELEM:
+                emit(OP_STOREA, lv.a, lv.b, r);
+                break;
+        default:
+                break;  // trapped on load already
+        }
+}
+
+static int compile_symref_expr(struct ProcCompiler *pc, Expr x)
+{
+        Symbol sym = expr_symbol(x);
+
+        if (sym == -1)
+                return emit_trap(pc, TRAP_UNRESOLVED, x);
+        if (symbolInfo[sym].kind != SYMBOL_DATA &&
+            symbolInfo[sym].kind != SYMBOL_PARAM)
+                return emit_trap(pc, TRAP_NOT_A_VALUE, x);
+        return load_lvalue(pc, compile_lvalue(pc, x), x);
+}
+
+static int compile_unop_expr(struct ProcCompiler *pc, Expr x)
+{
+        Expr xx = exprInfo[x].tUnop.expr;
+        struct Lvalue lv;
+        int r;
+        int v;
+
+        switch (exprInfo[x].opkind) {
+        case UNOP_INVERTBITS:
+        case UNOP_NOT:
+        case UNOP_NEGATIVE:
+                v = compile_expr(pc, xx);
+                r = new_temp(pc);
+                emit(exprInfo[x].opkind == UNOP_INVERTBITS ? OP_INV :
+                     exprInfo[x].opkind == UNOP_NOT ? OP_NOT : OP_NEG,
+                     r, v, 0);
+                return r;
+        case UNOP_POSITIVE:
+                return compile_expr(pc, xx);
+        case UNOP_PREDECREMENT:
+        case UNOP_PREINCREMENT:
+                lv = compile_lvalue(pc, xx);
+                v = load_lvalue(pc, lv, xx);
+                r = new_temp(pc);
+                emit(exprInfo[x].opkind == UNOP_PREINCREMENT ? OP_INC : OP_DEC,
+                     r, v, 0);
+                store_lvalue(lv, r);
+                return r;
+        case UNOP_POSTDECREMENT:
+        case UNOP_POSTINCREMENT:
+                lv = compile_lvalue(pc, xx);
+                v = load_lvalue(pc, lv, xx);
+                r = new_temp(pc);
+                emit(OP_MOVE, r, v, 0);
+                emit(exprInfo[x].opkind == UNOP_POSTINCREMENT ? OP_INC : OP_DEC,
+                     v, v, 0);
+                store_lvalue(lv, v);
+                return r;
+        default:
+                return emit_trap(pc, TRAP_UNSUPPORTED, x);
+        }
+}
+
+static int compile_binop_expr(struct ProcCompiler *pc, Expr x)
+{
+        static const int binopToOp[NUM_BINOPS] = {
+                [BINOP_EQUALS] = OP_EQ,
+                [BINOP_MINUS] = OP_SUB,
+                [BINOP_PLUS] = OP_ADD,
+                [BINOP_MUL] = OP_MUL,
+                [BINOP_DIV] = OP_DIV,
+                [BINOP_BITAND] = OP_AND,
+                [BINOP_BITOR] = OP_OR,
+                [BINOP_BITXOR] = OP_XOR,
+        };
+        Expr x1 = exprInfo[x].tBinop.expr1;
+        Expr x2 = exprInfo[x].tBinop.expr2;
+        int r1;
+        int r2;
+        int r;
+
+        if (exprInfo[x].opkind == BINOP_ASSIGN) {
+                struct Lvalue lv = compile_lvalue(pc, x1);
+                if (lv.kind == LVALUE_BAD)
+                        return emit_trap(pc, lv.a, x1);
+                r = compile_expr(pc, x2);
+                store_lvalue(lv, r);
+                return r;
+        }
+        r1 = compile_expr(pc, x1);
+        r2 = compile_expr(pc, x2);
+        r = new_temp(pc);
+        emit(binopToOp[exprInfo[x].opkind], r, r1, r2);
+        return r;
+}
+
+static int compile_call_expr(struct ProcCompiler *pc, Expr x)
+{
+        Expr callee = exprInfo[x].tCall.callee;
+        Symbol sym = expr_symbol(callee);
+        int first = exprInfo[x].tCall.firstArgIdx;
+        int nargs = exprInfo[x].tCall.nargs;
+        int args;
+        int r;
+        Proc proc;
+
+        if (sym == -1 || symbolInfo[sym].kind != SYMBOL_PROC)
+                return emit_trap(pc, TRAP_NOT_A_PROC, callee);
+        proc = symbolInfo[sym].tProc;
+        if (nargs != procInfo[proc].nparams)
+                return emit_trap(pc, TRAP_BAD_ARGCOUNT, x);
+        /* The arguments go to consecutive registers */
+        args = pc->top;
+        pc->top += nargs;
+        if (pc->nregs < pc->top)
+                pc->nregs = pc->top;
+        for (int i = 0; i < nargs; i++) {
+                int v = compile_expr(pc, callArgInfo[first + i].argExpr);
+                if (v != args + i)
+                        emit(OP_MOVE, args + i, v, 0);
+                pc->top = args + nargs;
+        }
+        r = new_temp(pc);
+        emit(OP_CALL, r, proc, args);
+        return r;
+}
+
+static int compile_expr(struct ProcCompiler *pc, Expr x)
+{
+        int r;
+
+        switch (exprInfo[x].kind) {
+        case EXPR_LITERAL:
+                r = new_temp(pc);
+                emit(OP_LITERAL, r,
+                     tokenValue[exprInfo[x].tLiteral.tok].literal, 0);
+                return r;
+        case EXPR_SYMREF:
+                return compile_symref_expr(pc, x);
+        case EXPR_UNOP:
+                return compile_unop_expr(pc, x);
+        case EXPR_BINOP:
+                return compile_binop_expr(pc, x);
+        case EXPR_SUBSCRIPT: {
+                struct Lvalue lv = compile_lvalue(pc, x);
+                return load_lvalue(pc, lv, x);
+        }
+        case EXPR_CALL:
+                return compile_call_expr(pc, x);
+        default:
+                return emit_trap(pc, TRAP_UNSUPPORTED, x);
+        }
+}
+
+/* Compiles a condition and a jump that is taken if it is false. Returns the
+ * jump, whose target must be patched. */
+static Instr compile_condition(struct ProcCompiler *pc, Expr x)
+{
+        Instr jump = emit(OP_JUMPZ, -1, compile_expr(pc, x), 0);
+        pc->top = pc->nlocals;
+        return jump;
+}
+
+static void compile_stmt(struct ProcCompiler *pc, Stmt stmt)
+{
+        Instr top;
+        Instr jump;
+
+        switch (stmtInfo[stmt].kind) {
+        case STMT_IF:
+                jump = compile_condition(pc, stmtInfo[stmt].tIf.condExpr);
+                compile_stmt(pc, stmtInfo[stmt].tIf.childStmt);
+                instrInfo[jump].a = instrCnt;
+                break;
+        case STMT_FOR:
+                compile_stmt(pc, stmtInfo[stmt].tFor.initStmt);
+                top = instrCnt;
+                jump = compile_condition(pc, stmtInfo[stmt].tFor.condExpr);
+                compile_stmt(pc, stmtInfo[stmt].tFor.childStmt);
+                compile_stmt(pc, stmtInfo[stmt].tFor.stepStmt);
+                emit(OP_JUMP, top, 0, 0);
+                instrInfo[jump].a = instrCnt;
+                break;
+        case STMT_WHILE:
+                top = instrCnt;
+                jump = compile_condition(pc, stmtInfo[stmt].tWhile.condExpr);
+                compile_stmt(pc, stmtInfo[stmt].tWhile.childStmt);
+                emit(OP_JUMP, top, 0, 0);
+                instrInfo[jump].a = instrCnt;
+                break;
+        case STMT_RETURN:
+                emit(OP_RETURN, compile_expr(pc, stmtInfo[stmt].tReturn.expr),
+                     0, 0);
+                pc->top = pc->nlocals;
+                break;
+        case STMT_EXPR:
+                compile_expr(pc, stmtInfo[stmt].tExpr.expr);
+                pc->top = pc->nlocals;
+                break;
+        case STMT_COMPOUND: {
+                int first = stmtInfo[stmt].tCompound.firstChildStmtIdx;
+                int last = first + stmtInfo[stmt].tCompound.numStatements;
+                for (int i = first; i < last; i++)
+                        compile_stmt(pc, childStmtInfo[i].child);
+                break;
+        }
+        case STMT_DATA:
+                emit(OP_IMM, pc->dataReg[stmtInfo[stmt].tData], 0, 0);
+                break;
+        case STMT_ARRAY:
+                break;
+        default:
+                UNHANDLED_CASE();
+        }
+}
+
+static void compile_proc(Proc proc, int *dataReg)
+{
+        struct ProcCompiler pc;
+        Scope scope = procInfo[proc].scope;
+        Symbol first = scopeInfo[scope].firstSymbol;
+        Symbol last = first + scopeInfo[scope].numSymbols;
+        int r;
+
+        pc.proc = proc;
+        pc.dataReg = dataReg;
+        pc.nlocals = procInfo[proc].nparams;
+        for (Symbol sym = first; sym < last; sym++)
+                if (symbolInfo[sym].kind == SYMBOL_DATA)
+                        dataReg[symbolInfo[sym].tData] = pc.nlocals++;
+        pc.top = pc.nlocals;
+        pc.nregs = pc.nlocals;
+
+        procInfo[proc].firstInstr = instrCnt;
+        compile_stmt(&pc, procInfo[proc].body);
+        /* falling off the end returns 0 */
+        r = new_temp(&pc);
+        emit(OP_IMM, r, 0, 0);
+        emit(OP_RETURN, r, 0, 0);
+        procInfo[proc].nregs = pc.nregs;
+}
+
+/* Compiles all procs to bytecode */
+void compile_bytecode(void)
+{
+        int *dataReg;
+        struct Alloc dataRegAlloc;
+
+        BUF_INIT(dataReg, dataRegAlloc);
+        BUF_RESERVE(dataReg, dataRegAlloc, dataCnt);
+        instrCnt = 0;
+        for (Proc p = 0; p < procCnt; p++)
+                compile_proc(p, dataReg);
+        BUF_EXIT(dataReg, dataRegAlloc);
+}
+
+struct ArrayStorage {
+        long long *elems;
+        struct Alloc elemsAlloc;
+        int elemCnt;
+};
+
+/* Registers of all running procs together. Their bytes must fit in a heap
+ * buffer, and 1 GiB is the size of the native code's stack, too. */
+#define MAX_STACK_REGS (1 << 27)
+
+struct Frame {
+        const struct InstrInfo *ret;
+        int base;
+        int nregs;
+        int result;  // register of the caller that receives the result
+};
+
+/* Fails with the error of an OP_TRAP instruction with operands trap and x */
+void NORETURN bytecode_trap(int trap, Expr x)
+{
+        File file;
+        int offset;
+
+        find_expr_position(x, &file, &offset);
+        FATAL("At %s %d:%d: %s\n", string_buffer(fileInfo[file].filepath),
+              compute_lineno(file, offset), compute_colno(file, offset),
+              trapString[trap]);
+}
+
+/* Fails with the error of a runtime check, see enum RuntimeError */
+void NORETURN runtime_error(int error, long long arg)
+{
+        switch (error) {
+        case RUNTIME_DIVISION_BY_ZERO:
+                FATAL("Division by zero\n");
+        case RUNTIME_NEGATIVE_INDEX:
+                FATAL("Negative array index %lld\n", arg);
+        case RUNTIME_INDEX_OUT_OF_RANGE:
+                FATAL("Array index %lld out of range\n", arg);
+        case RUNTIME_STACK_OVERFLOW:
+                FATAL("Stack overflow\n");
+        default:
+                UNHANDLED_CASE();
+        }
+}
+
+/* Runs proc, which must not have params, and returns its result. The global
+ * data and the arrays start out as zeros. compile_bytecode() must have been
+ * called. */
+long long run_proc(Proc proc)
+{
+        long long *global;
+        struct ArrayStorage *array;
+        long long *stack;
+        struct Frame *frame;
+        struct Alloc globalAlloc;
+        struct Alloc arrayAlloc;
+        struct Alloc stackAlloc;
+        struct Alloc frameAlloc;
+        int frameCnt = 0;
+        int base = 0;
+        int nregs;
+        long long *r;
+        const struct InstrInfo *ip;
+        long long result;
+
+        if (procInfo[proc].nparams != 0)
+                FATAL("Can't run proc %s: it takes arguments\n",
+                      SS(procInfo[proc].sym));
+
+        BUF_INIT(global, globalAlloc);
+        BUF_INIT(array, arrayAlloc);
+        BUF_INIT(stack, stackAlloc);
+        BUF_INIT(frame, frameAlloc);
+        BUF_RESERVE(global, globalAlloc, dataCnt);
+        BUF_RESERVE(array, arrayAlloc, arrayCnt);
+        mem_fill(global, 0, dataCnt * (int) sizeof *global);
+        for (Array i = 0; i < arrayCnt; i++) {
+                BUF_INIT(array[i].elems, array[i].elemsAlloc);
+                array[i].elemCnt = 0;
+        }
+
+        nregs = procInfo[proc].nregs;
+        BUF_RESERVE(stack, stackAlloc, nregs);
+        mem_fill(stack, 0, nregs * (int) sizeof *stack);
+        r = stack;
+        ip = &instrInfo[procInfo[proc].firstInstr];
+
+        /* With GCC and Clang, each handler jumps to the next one through a
+         * table of label addresses ("computed goto"). That's one indirect
+         * jump per instruction, which branch predictors handle much better
+         * than the single shared jump of a switch. */
+#ifdef __GNUC__
+        static const void *const label[NUM_OPS] = {
+#define X(op) [op] = &&L_##op,
+                X(OP_LITERAL) X(OP_IMM) X(OP_MOVE) X(OP_LOADG) X(OP_STOREG)
+                X(OP_LOADA) X(OP_STOREA) X(OP_ADD) X(OP_SUB) X(OP_MUL)
+                X(OP_DIV) X(OP_AND) X(OP_OR) X(OP_XOR) X(OP_EQ) X(OP_NEG)
+                X(OP_NOT) X(OP_INV) X(OP_INC) X(OP_DEC) X(OP_JUMP)
+                X(OP_JUMPZ) X(OP_CALL) X(OP_RETURN) X(OP_TRAP)
+#undef X
+        };
+#define CASE(op) L_##op
+#define DISPATCH() goto *label[ip->op]
+        DISPATCH();
+#else
+#define CASE(op) case op
+#define DISPATCH() goto dispatch
+dispatch:
+        switch (ip->op) {
+#endif
+        CASE(OP_LITERAL):
+                r[ip->a] = integerLiteral[ip->b];
+                ip++;
+                DISPATCH();
+        CASE(OP_IMM):
+                r[ip->a] = ip->b;
+                ip++;
+                DISPATCH();
+        CASE(OP_MOVE):
+                r[ip->a] = r[ip->b];
+                ip++;
+                DISPATCH();
+        CASE(OP_LOADG):
+                r[ip->a] = global[ip->b];
+                ip++;
+                DISPATCH();
+        CASE(OP_STOREG):
+                global[ip->a] = r[ip->b];
+                ip++;
+                DISPATCH();
+        CASE(OP_LOADA): {
+                struct ArrayStorage *a = &array[ip->b];
+                long long i = r[ip->c];
+                if (i < 0)
+                        runtime_error(RUNTIME_NEGATIVE_INDEX, i);
+                if (i >= MAX_ARRAY_LENGTH)
+                        runtime_error(RUNTIME_INDEX_OUT_OF_RANGE, i);
+                r[ip->a] = i < a->elemCnt ? a->elems[i] : 0;
+                ip++;
+                DISPATCH();
+        }
+        CASE(OP_STOREA): {
+                struct ArrayStorage *a = &array[ip->a];
+                long long i = r[ip->b];
+                if (i < 0)
+                        runtime_error(RUNTIME_NEGATIVE_INDEX, i);
+                if (i >= MAX_ARRAY_LENGTH)
+                        runtime_error(RUNTIME_INDEX_OUT_OF_RANGE, i);
+                if (i >= a->elemCnt) {
+                        /* elements past elemCnt are never written, so
+                         * clearing new capacity keeps them 0 */
+                        BUF_RESERVE_Z(a->elems, a->elemsAlloc, (int) i + 1);
+                        a->elemCnt = (int) i + 1;
+                }
+                a->elems[i] = r[ip->c];
+                ip++;
+                DISPATCH();
+        }
+        /* Arithmetic wraps around like with unsigned numbers */
+        CASE(OP_ADD):
+                r[ip->a] = (long long) ((unsigned long long) r[ip->b] +
+                                        (unsigned long long) r[ip->c]);
+                ip++;
+                DISPATCH();
+        CASE(OP_SUB):
+                r[ip->a] = (long long) ((unsigned long long) r[ip->b] -
+                                        (unsigned long long) r[ip->c]);
+                ip++;
+                DISPATCH();
+        CASE(OP_MUL):
+                r[ip->a] = (long long) ((unsigned long long) r[ip->b] *
+                                        (unsigned long long) r[ip->c]);
+                ip++;
+                DISPATCH();
+        CASE(OP_DIV):
+                if (r[ip->c] == 0)
+                        runtime_error(RUNTIME_DIVISION_BY_ZERO, 0);
+                if (r[ip->c] == -1)  // avoid overflow trap of LLONG_MIN / -1
+                        r[ip->a] = (long long) (0 - (unsigned long long)
+                                                r[ip->b]);
+                else
+                        r[ip->a] = r[ip->b] / r[ip->c];
+                ip++;
+                DISPATCH();
+        CASE(OP_AND):
+                r[ip->a] = r[ip->b] & r[ip->c];
+                ip++;
+                DISPATCH();
+        CASE(OP_OR):
+                r[ip->a] = r[ip->b] | r[ip->c];
+                ip++;
+                DISPATCH();
+        CASE(OP_XOR):
+                r[ip->a] = r[ip->b] ^ r[ip->c];
+                ip++;
+                DISPATCH();
+        CASE(OP_EQ):
+                r[ip->a] = r[ip->b] == r[ip->c];
+                ip++;
+                DISPATCH();
+        CASE(OP_NEG):
+                r[ip->a] = (long long) (0 - (unsigned long long) r[ip->b]);
+                ip++;
+                DISPATCH();
+        CASE(OP_NOT):
+                r[ip->a] = !r[ip->b];
+                ip++;
+                DISPATCH();
+        CASE(OP_INV):
+                r[ip->a] = ~r[ip->b];
+                ip++;
+                DISPATCH();
+        CASE(OP_INC):
+                r[ip->a] = (long long) ((unsigned long long) r[ip->b] + 1);
+                ip++;
+                DISPATCH();
+        CASE(OP_DEC):
+                r[ip->a] = (long long) ((unsigned long long) r[ip->b] - 1);
+                ip++;
+                DISPATCH();
+        CASE(OP_JUMP):
+                ip = &instrInfo[ip->a];
+                DISPATCH();
+        CASE(OP_JUMPZ):
+                if (r[ip->b])
+                        ip++;
+                else
+                        ip = &instrInfo[ip->a];
+                DISPATCH();
+        CASE(OP_CALL): {
+                Proc callee = ip->b;
+                int newbase = base + nregs;
+                int newnregs = procInfo[callee].nregs;
+                int nparams = procInfo[callee].nparams;
+                if (frameCnt + 1 == MAX_CALL_DEPTH ||
+                    newbase + newnregs > MAX_STACK_REGS)
+                        runtime_error(RUNTIME_STACK_OVERFLOW, 0);
+                BUF_RESERVE(frame, frameAlloc, frameCnt + 1);
+                frame[frameCnt].ret = ip + 1;
+                frame[frameCnt].base = base;
+                frame[frameCnt].nregs = nregs;
+                frame[frameCnt].result = ip->a;
+                frameCnt++;
+                BUF_RESERVE(stack, stackAlloc, newbase + newnregs);
+                mem_copy(stack + newbase, stack + base + ip->c,
+                         nparams * (int) sizeof *stack);
+                mem_fill(stack + newbase + nparams, 0,
+                         (newnregs - nparams) * (int) sizeof *stack);
+                base = newbase;
+                nregs = newnregs;
+                r = stack + base;
+                ip = &instrInfo[procInfo[callee].firstInstr];
+                DISPATCH();
+        }
+        CASE(OP_RETURN): {
+                long long value = r[ip->a];
+                if (frameCnt == 0) {
+                        result = value;
+                        goto done;
+                }
+                frameCnt--;
+                base = frame[frameCnt].base;
+                nregs = frame[frameCnt].nregs;
+                r = stack + base;
+                r[frame[frameCnt].result] = value;
+                ip = frame[frameCnt].ret;
+                DISPATCH();
+        }
+        CASE(OP_TRAP):
+                bytecode_trap(ip->a, ip->b);
+#ifndef __GNUC__
+        default:
+                UNHANDLED_CASE();
+        }
+#endif
+#undef CASE
+#undef DISPATCH
+
+done:
+        for (Array i = 0; i < arrayCnt; i++)
+                BUF_EXIT(array[i].elems, array[i].elemsAlloc);
+        BUF_EXIT(global, globalAlloc);
+        BUF_EXIT(array, arrayAlloc);
+        BUF_EXIT(stack, stackAlloc);
+        BUF_EXIT(frame, frameAlloc);
+        return result;
+}
@@ -1,24 +1,98 @@
 #include "defs.h"
 #include "api.h"
+#include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Address space reserved for an arena buffer (see BUF_INIT_ARENA): enough for
+ * as many elements as an int can count, so an arena never runs out before
+ * its element count does. Only the part that is actually used gets backed by
+ * memory, and the reservation itself costs next to nothing on 64-bit
+ * systems. */
+#define ARENA_SIZE(elsize) ((size_t) (elsize) << 31)
+
+#ifndef _MSC_VER
+/* Try to map the file read-only. Returns 0 if that isn't possible (e.g. the
+ * file is a pipe), in which case the caller falls back to stdio. The mapping
+ * is at least one byte larger than the file and the excess is zero-filled, so
+ * buf[size] == '\0' holds just as in the stdio case. */
+static int map_whole_file(File file, const char *path)
+{
+        int fd;
+        struct stat st;
+        size_t pagesize;
+        size_t mapsize;
+        void *p;
+
+        fd = open(path, O_RDONLY);
+        if (fd == -1)
+                return 0;
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+            st.st_size >= INT_MAX) {
+                close(fd);
+                return 0;
+        }
+        /* Reserve one page more than needed for the contents. If the size of
+         * the file is a multiple of the page size, this page is the sentinel.
+         * Otherwise, the kernel zero-fills the tail of the last file page. */
+        pagesize = (size_t) sysconf(_SC_PAGESIZE);
+        mapsize = ((size_t) st.st_size / pagesize + 1) * pagesize;
+        p = mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+                close(fd);
+                return 0;
+        }
+        if (st.st_size > 0 &&
+            mmap(p, (size_t) st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+                 fd, 0) == MAP_FAILED) {
+                munmap(p, mapsize);
+                close(fd);
+                return 0;
+        }
+        close(fd);
+        fileInfo[file].buf = p;
+        fileInfo[file].size = (int) st.st_size;
+        fileInfo[file].isMapped = 1;
+        CLEAR(fileInfo[file].bufAlloc);
+        return 1;
+}
+#endif
 
 void read_whole_file(File file)
 {
         FILE *f;
         size_t nread;
         const int chunksize = 4096;
-        String fpath;
+        const char *fpath;
 
-        fpath = fileInfo[file].filepath;
-        f = fopen(string_buffer(fpath), "rb");
+        fpath = string_buffer(fileInfo[file].filepath);
+#ifndef _MSC_VER
+        if (cstr_compare(fpath, "-") != 0 && map_whole_file(file, fpath))
+                return;
+#endif
+        if (cstr_compare(fpath, "-") == 0)
+                f = stdin;
+        else
+                f = fopen(fpath, "rb");
         if (f == NULL)
-                FATAL("Failed to open file %s", fpath);
+                FATAL("Failed to open file %s\n", fpath);
 
         BUF_INIT(fileInfo[file].buf, fileInfo[file].bufAlloc);
         fileInfo[file].size = 0;
+        fileInfo[file].isMapped = 0;
         while (!feof(f) && !ferror(f)) {
                 BUF_RESERVE(fileInfo[file].buf,
                             fileInfo[file].bufAlloc,
@@ -29,13 +103,64 @@ void read_whole_file(File file)
         }
         if (ferror(f))
                 FATAL("I/O error while reading from %s\n", fpath);
-        fclose(f);
+        if (f != stdin)
+                fclose(f);
         BUF_RESERVE(fileInfo[file].buf,
                     fileInfo[file].bufAlloc,
                     fileInfo[file].size + 1);
         fileInfo[file].buf[fileInfo[file].size] = '\0';
 }
 
+/* Releases the file's buffer and line index */
+void close_file(File file)
+{
+        if (fileInfo[file].isMapped) {
+#ifndef _MSC_VER
+                size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+                size_t size = (size_t) fileInfo[file].size;
+                munmap(fileInfo[file].buf, (size / pagesize + 1) * pagesize);
+#endif
+                fileInfo[file].buf = NULL;
+        }
+        else {
+                BUF_EXIT(fileInfo[file].buf, fileInfo[file].bufAlloc);
+        }
+        BUF_EXIT(fileInfo[file].lineStart, fileInfo[file].lineStartAlloc);
+        fileInfo[file].lineCnt = 0;
+}
+
+void index_lines(File file)
+{
+        const unsigned char *buf = fileInfo[file].buf;
+        int size = fileInfo[file].size;
+        int i = 0;
+
+        BUF_INIT(fileInfo[file].lineStart, fileInfo[file].lineStartAlloc);
+        fileInfo[file].lineCnt = 0;
+        BUF_APPEND(fileInfo[file].lineStart, fileInfo[file].lineStartAlloc,
+                   fileInfo[file].lineCnt, 0);
+#ifdef __SSE2__
+        const __m128i nl = _mm_set1_epi8('\n');
+        for (; i + 16 <= size; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *) &buf[i]);
+                unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+                while (mask) {
+                        int pos = i + __builtin_ctz(mask) + 1;
+                        BUF_APPEND(fileInfo[file].lineStart,
+                                   fileInfo[file].lineStartAlloc,
+                                   fileInfo[file].lineCnt, pos);
+                        mask &= mask - 1;
+                }
+        }
+#endif
+        for (; i < size; i++) {
+                if (buf[i] == '\n')
+                        BUF_APPEND(fileInfo[file].lineStart,
+                                   fileInfo[file].lineStartAlloc,
+                                   fileInfo[file].lineCnt, i + 1);
+        }
+}
+
 void mem_fill(void *ptr, int val, int size)
 {
         memset(ptr, val, size);
@@ -43,7 +168,8 @@ void mem_fill(void *ptr, int val, int size)
 
 void mem_copy(void *dst, const void *src, int size)
 {
-        memcpy(dst, src, size);
+        if (size > 0)  // empty buffers may be NULL
+                memcpy(dst, src, size);
 }
 
 int mem_compare(const void *m1, const void *m2, int size)
@@ -72,6 +198,85 @@ void sort_array(void *ptr, int nelems, int elemsize,
         qsort(ptr, nelems, elemsize, cmp);
 }
 
+#ifndef _MSC_VER
+struct ParallelFor {
+        void (*func)(void *arg, int first, int last);
+        void *arg;
+        int cnt;
+        int chunksize;
+        int next;  // first index of the next chunk to hand out
+        struct CompileContext ctx;  // the calling thread's compilation
+};
+
+static void run_chunks(struct ParallelFor *pf)
+{
+        for (;;) {
+                int first = __atomic_fetch_add(&pf->next, pf->chunksize,
+                                               __ATOMIC_RELAXED);
+                if (first >= pf->cnt)
+                        break;
+                int last = first + pf->chunksize;
+                if (last > pf->cnt)
+                        last = pf->cnt;
+                pf->func(pf->arg, first, last);
+        }
+}
+
+static void *run_chunks_thread(void *arg)
+{
+        struct ParallelFor *pf = arg;
+        enter_compile_context(&pf->ctx);
+        run_chunks(pf);
+        return NULL;
+}
+#endif
+
+/* Calls func(arg, first, last) for consecutive chunks [first, last) of size
+ * chunksize (the last one may be smaller) that together cover [0, cnt). The
+ * chunks are handed out on demand to up to nthreads threads, including the
+ * calling thread, so threads that finish early take over remaining work.
+ * Returns when all chunks are done. The other threads work in a copy of the
+ * caller's compile context. They may read the tables and write to table
+ * elements that exist already, but must not add elements. */
+void parallel_for(int nthreads, int cnt, int chunksize,
+                  void (*func)(void *arg, int first, int last), void *arg)
+{
+        int nchunks = (cnt + chunksize - 1) / chunksize;
+
+        if (nthreads > nchunks)
+                nthreads = nchunks;
+#ifndef _MSC_VER
+        if (nthreads > 1) {
+                struct ParallelFor pf = {
+                        .func = func,
+                        .arg = arg,
+                        .cnt = cnt,
+                        .chunksize = chunksize,
+                };
+                pthread_t threads[64];
+                int started = 0;
+
+                leave_compile_context(&pf.ctx);
+
+                if (nthreads > LENGTH(threads))
+                        nthreads = LENGTH(threads);
+                for (int i = 1; i < nthreads; i++) {
+                        if (pthread_create(&threads[started], NULL,
+                                           run_chunks_thread, &pf) != 0)
+                                break;  // fewer threads will do
+                        started++;
+                }
+                run_chunks(&pf);
+                for (int i = 0; i < started; i++)
+                        pthread_join(threads[i], NULL);
+                return;
+        }
+#endif
+        for (int first = 0; first < cnt; first += chunksize)
+                func(arg, first, first + chunksize < cnt ?
+                                 first + chunksize : cnt);
+}
+
 void output(const char *fmt, ...)
 {
         va_list ap;
@@ -80,14 +285,89 @@ void output(const char *fmt, ...)
         va_end(ap);
 }
 
+/* Writes to stdout with as few system calls as possible. Whatever is still
+ * in stdio's buffer is flushed first, to keep the output in order. */
+void output_bytes(const char *buf, int len)
+{
+        fflush(stdout);
+#ifndef _MSC_VER
+        while (len > 0) {
+                ssize_t n = write(STDOUT_FILENO, buf, (size_t) len);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        FATAL("Failed to write output: %s\n",
+                              strerror(errno));
+                }
+                buf += n;
+                len -= (int) n;
+        }
+#else
+        fwrite(buf, 1, len, stdout);
+#endif
+}
+
+/* If set, messages of this thread are appended here instead of printed */
+static THREAD_LOCAL struct MessageBuffer *messageBuffer;
+
+void init_message_buffer(struct MessageBuffer *mb)
+{
+        BUF_INIT(mb->buf, mb->bufAlloc);
+        mb->bufCnt = 0;
+}
+
+void exit_message_buffer(struct MessageBuffer *mb)
+{
+        BUF_EXIT(mb->buf, mb->bufAlloc);
+}
+
+/* Pass NULL to print messages to stdout again */
+void set_message_buffer(struct MessageBuffer *mb)
+{
+        messageBuffer = mb;
+}
+
+void flush_message_buffer(struct MessageBuffer *mb)
+{
+        if (mb->bufCnt > 0)
+                fwrite(mb->buf, 1, mb->bufCnt, stdout);
+        mb->bufCnt = 0;
+}
+
+static void vmsg_printf(const char *fmt, va_list ap)
+{
+        struct MessageBuffer *mb = messageBuffer;
+        va_list aq;
+        int len;
+
+        if (!mb) {
+                vfprintf(stdout, fmt, ap);
+                return;
+        }
+        va_copy(aq, ap);
+        len = vsnprintf(NULL, 0, fmt, aq);
+        va_end(aq);
+        BUF_RESERVE(mb->buf, mb->bufAlloc, mb->bufCnt + len + 1);
+        vsnprintf(mb->buf + mb->bufCnt, len + 1, fmt, ap);
+        mb->bufCnt += len;
+}
+
+static void msg_printf(const char *fmt, ...)
+{
+        va_list ap;
+        va_start(ap, fmt);
+        vmsg_printf(fmt, ap);
+        va_end(ap);
+}
+
 void _vmsg(UNUSED const char *filename, UNUSED int line,
           const char *loglevel, const char *fmt, va_list ap)
 {
 #ifndef NODEBUG
-        fprintf(stdout, "%s:%d:\t", filename, line);
+        msg_printf("%s:%d:\t", filename, line);
 #endif
-        fprintf(stdout, "%s: ", loglevel);
-        vfprintf(stdout, fmt, ap);
+        msg_printf("%s: ", loglevel);
+        vmsg_printf(fmt, ap);
 }
 
 void _msg(UNUSED const char *filename, UNUSED int line,
@@ -104,6 +384,7 @@ void NORETURN _fatal(UNUSED const char *filename, UNUSED int line,
 {
         va_list ap;
         va_start(ap, fmt);
+        messageBuffer = NULL;  // make sure that it gets printed
         _vmsg(filename, line, "FATAL", fmt, ap);
         va_end(ap);
         abort();
@@ -116,30 +397,101 @@ void _buf_init(void **ptr, struct Alloc *alloc, UNUSED int elsize,
         CLEAR(*alloc);
 }
 
-void _buf_exit(void **ptr, struct Alloc *alloc, UNUSED int elsize,
+/* Falls back to a heap buffer where virtual memory can't be reserved */
+void _buf_init_arena(void **ptr, struct Alloc *alloc, UNUSED int elsize,
+                     UNUSED const char *file, UNUSED int line)
+{
+        *ptr = NULL;
+        CLEAR(*alloc);
+#ifndef _MSC_VER
+        alloc->isArena = 1;
+#endif
+}
+
+void _buf_exit(void **ptr, struct Alloc *alloc, int elsize,
                UNUSED const char *file, UNUSED int line)
 {
-        free(*ptr);
+#ifndef _MSC_VER
+        if (alloc->isArena) {
+                if (*ptr)
+                        munmap(*ptr, ARENA_SIZE(elsize));
+        }
+        else
+#endif
+                free(*ptr);
         *ptr = NULL;
         CLEAR(*alloc);
 }
 
+#ifndef _MSC_VER
+/* Makes room for nelems elements in an arena buffer. Like heap buffers, the
+ * accessible part doubles in size, but it grows in place. Pages that are made
+ * accessible for the first time read as zero, so clearing is never needed.
+ * Returns 0 if no address space could be reserved for an empty buffer. */
+static int arena_reserve(void **ptr, struct Alloc *alloc, int nelems,
+                         int elsize)
+{
+        size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+        size_t size = ARENA_SIZE(elsize);
+        size_t need = (size_t) nelems * elsize;
+        size_t oldsize;
+        size_t newsize;
+        void *p;
+
+        if (*ptr == NULL) {
+                p = mmap(NULL, size, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                if (p == MAP_FAILED)
+                        return 0;
+                *ptr = p;
+        }
+        oldsize = (size_t) alloc->cap * elsize & ~(pagesize - 1);
+        newsize = pagesize;
+        while (newsize < need)
+                newsize *= 2;
+        if (newsize > size)
+                newsize = size;
+        if (mprotect((char *) *ptr + oldsize, newsize - oldsize,
+                     PROT_READ | PROT_WRITE) != 0)
+                FATAL("Out of memory growing a buffer to %zu bytes\n",
+                      newsize);
+        alloc->cap = newsize / elsize > INT_MAX ?
+                     INT_MAX : (int) (newsize / elsize);
+        return 1;
+}
+#endif
+
 void _buf_reserve(void **ptr, struct Alloc *alloc, int nelems, int elsize,
                   int clear, UNUSED const char *file, UNUSED int line)
 {
-        int cnt;
+        long long cnt;
         void *p;
+#ifndef _MSC_VER
+        if (alloc->isArena) {
+                if (alloc->cap >= nelems ||
+                    arena_reserve(ptr, alloc, nelems, elsize))
+                        return;
+                alloc->isArena = 0;  // no address space left, use the heap
+        }
+#endif
         if (alloc->cap < nelems) {
-                cnt = 2 * nelems - 1;
-                while (cnt & (cnt - 1))
-                        cnt = cnt & (cnt - 1);
-                p = mem_realloc(*ptr, cnt * elsize);
+                cnt = 1;
+                while (cnt < nelems)
+                        cnt *= 2;
+                if (cnt * elsize > INT_MAX)
+                        cnt = INT_MAX / elsize;
+                if (cnt < nelems)
+                        FATAL("Buffer of %d elements of %d bytes exceeds "
+                              "the 2 GiB limit of heap buffers\n",
+                              nelems, elsize);
+                p = mem_realloc(*ptr, (int) (cnt * elsize));
                 if (!p)
-                        FATAL("OOM!");
+                        FATAL("Out of memory growing a buffer to %lld "
+                              "bytes\n", cnt * elsize);
                 if (clear)
-                        mem_fill((char*)p + alloc->cap * elsize, 0,
-                                 (cnt - alloc->cap) * elsize);
+                        mem_fill((char*)p + (size_t) alloc->cap * elsize, 0,
+                                 (int) ((cnt - alloc->cap) * elsize));
                 *ptr = p;
-                alloc->cap = cnt;
+                alloc->cap = (int) cnt;
         }
 }
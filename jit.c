@@ -0,0 +1,543 @@
+#include "defs.h"
+#include "api.h"
+
+/* A native code generator for x86-64. It translates the bytecode of
+ * compile_bytecode() into machine code in executable memory, so each
+ * bytecode instruction becomes a few machine instructions and there is no
+ * dispatch at runtime.
+ *
+ * Each proc becomes a real function that follows the System V calling
+ * convention, so procs call each other with plain call instructions. The
+ * registers of the bytecode live in the stack frame of the function, at
+ * [rbp - 8 * (i + 1)] for register i. The global data are a zero-initialized
+ * block, like the .bss section of an executable. Each array is a contiguous
+ * column of MAX_ARRAY_LENGTH elements, which is reserved address space that
+ * gets backed by zeroed memory only where it is touched. The runtime checks
+ * are the interpreter's, and failing checks and OP_TRAP instructions call
+ * the same C functions, so both backends give the same results and errors.
+ *
+ * The code is run on a thread with a large stack of its own, so deep
+ * recursion doesn't depend on the stack size limit of the main thread. */
+
+#if defined(__x86_64__) && !defined(_MSC_VER)
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define JIT_STACK_SIZE ((size_t) 1 << 30)
+#define JIT_STACK_RESERVE (64 * 1024)  // left for the C code of failures
+
+enum {
+        RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7, R8 = 8, R9 = 9, R11 = 11,
+};
+
+/* registers of the first six arguments */
+static const int argReg[6] = { RDI, RSI, RDX, RCX, R8, R9 };
+
+/* slots after the global data */
+enum {
+        JIT_STACK_LIMIT,  // lowest allowed rsp
+        JIT_CALL_DEPTH,  // procs running
+        NUM_JIT_SLOTS,
+};
+
+struct JitFixup {
+        int pos;  // of a rel32 operand in the code
+        int target;  // Instr of a jump or Proc of a call
+};
+
+struct Jit {
+        unsigned char *code;
+        struct JitFixup *jumpFixup;
+        struct JitFixup *callFixup;
+        int *instrOffset;  // code offset of each Instr
+        int *procOffset;  // code offset of each Proc
+        struct Alloc codeAlloc;
+        struct Alloc jumpFixupAlloc;
+        struct Alloc callFixupAlloc;
+        struct Alloc instrOffsetAlloc;
+        struct Alloc procOffsetAlloc;
+        int codeCnt;
+        int jumpFixupCnt;
+        int callFixupCnt;
+        long long *global;  // dataCnt global data, then the JIT_ slots
+        long long **column;  // one per array
+        struct Alloc columnAlloc;
+        char *columns;  // all columns in a single mapping
+        size_t columnsSize;
+        size_t globalSize;
+};
+
+struct JitRun {
+        struct CompileContext ctx;  // the calling thread's compilation
+        long long (*func)(void);
+        long long result;
+};
+
+static void put(struct Jit *j, const void *bytes, int len)
+{
+        BUF_RESERVE(j->code, j->codeAlloc, j->codeCnt + len);
+        mem_copy(j->code + j->codeCnt, bytes, len);
+        j->codeCnt += len;
+}
+
+#define PUT(j, ...) do { \
+        static const unsigned char bytes_[] = { __VA_ARGS__ }; \
+        put(j, bytes_, sizeof bytes_); \
+} while (0)
+
+static void put32(struct Jit *j, int x)
+{
+        put(j, &x, 4);
+}
+
+static void put64(struct Jit *j, unsigned long long x)
+{
+        put(j, &x, 8);
+}
+
+static int slot(int reg)
+{
+        return -8 * (reg + 1);
+}
+
+/* mov hw, [rbp + slot(reg)] or mov [rbp + slot(reg)], hw */
+static void move_slot(struct Jit *j, int opcode, int hw, int reg)
+{
+        unsigned char b[3] = {
+                (unsigned char) (hw >= 8 ? 0x4C : 0x48),
+                (unsigned char) opcode,
+                (unsigned char) (0x85 | (hw & 7) << 3),
+        };
+        put(j, b, 3);
+        put32(j, slot(reg));
+}
+
+static void load(struct Jit *j, int hw, int reg)
+{
+        move_slot(j, 0x8B, hw, reg);
+}
+
+static void store(struct Jit *j, int hw, int reg)
+{
+        move_slot(j, 0x89, hw, reg);
+}
+
+/* op rax, [rbp + slot(reg)] */
+static void op_slot(struct Jit *j, int opcode, int reg)
+{
+        move_slot(j, opcode, RAX, reg);
+}
+
+/* movabs hw, x */
+static void mov_imm64(struct Jit *j, int hw, unsigned long long x)
+{
+        unsigned char b[2] = {
+                (unsigned char) (hw >= 8 ? 0x49 : 0x48),
+                (unsigned char) (0xB8 + (hw & 7)),
+        };
+        put(j, b, 2);
+        put64(j, x);
+}
+
+/* Calls the C function f with edi = a and esi = b (rsi = rax if useRax),
+ * which must not return. With useRax, the sequence is CALL_OUT_LENGTH bytes
+ * long, so it can be skipped with a short jump (see fail_unless()). The
+ * stack must be aligned. */
+#define CALL_OUT_LENGTH 20
+static void call_out(struct Jit *j, void *f, int a, int b, int useRax)
+{
+        PUT(j, 0xBF);  // mov edi, a
+        put32(j, a);
+        if (useRax)
+                PUT(j, 0x48, 0x89, 0xC6);  // mov rsi, rax
+        else {
+                PUT(j, 0xBE);  // mov esi, b
+                put32(j, b);
+        }
+        mov_imm64(j, RAX, (uintptr_t) f);
+        PUT(j, 0xFF, 0xD0);  // call rax
+}
+
+/* The failure is called with rsi = rax and skipped with the short jump jcc,
+ * which must precede it */
+static void fail_unless(struct Jit *j, int jcc, int kind)
+{
+        int len = j->codeCnt;
+        unsigned char b[2] = { (unsigned char) jcc, CALL_OUT_LENGTH };
+        put(j, b, 2);
+        call_out(j, (void *) runtime_error, kind, 0, 1);
+        assert(j->codeCnt - len == 2 + CALL_OUT_LENGTH);
+}
+
+/* Checks the array index in rax like the interpreter does */
+static void check_index(struct Jit *j)
+{
+        PUT(j, 0x48, 0x85, 0xC0);  // test rax, rax
+        fail_unless(j, 0x79, RUNTIME_NEGATIVE_INDEX);  // jns
+        PUT(j, 0x48, 0x3D);  // cmp rax, imm32
+        put32(j, MAX_ARRAY_LENGTH);
+        fail_unless(j, 0x72, RUNTIME_INDEX_OUT_OF_RANGE);  // jb
+}
+
+static void add_fixup(struct JitFixup **fixup, struct Alloc *alloc, int *cnt,
+                      int pos, int target)
+{
+        int x = (*cnt)++;
+        BUF_RESERVE(*fixup, *alloc, *cnt);
+        (*fixup)[x].pos = pos;
+        (*fixup)[x].target = target;
+}
+
+static void jump_to(struct Jit *j, Instr target)
+{
+        add_fixup(&j->jumpFixup, &j->jumpFixupAlloc, &j->jumpFixupCnt,
+                  j->codeCnt, target);
+        put32(j, 0);
+}
+
+static void patch(struct Jit *j, int pos, int target)
+{
+        int rel = target - (pos + 4);
+        mem_copy(j->code + pos, &rel, 4);
+}
+
+static void emit_prologue(struct Jit *j, Proc proc)
+{
+        int nparams = procInfo[proc].nparams;
+        int nregs = procInfo[proc].nregs;
+        int frame = (8 * nregs + 15) & ~15;
+
+        PUT(j, 0x55);  // push rbp
+        PUT(j, 0x48, 0x89, 0xE5);  // mov rbp, rsp
+        /* the checks may only use rax and r11, which carry no arguments */
+        mov_imm64(j, R11, (uintptr_t) &j->global[dataCnt + JIT_CALL_DEPTH]);
+        PUT(j, 0x49, 0x83, 0x03, 0x01);  // add qword [r11], 1
+        PUT(j, 0x49, 0x81, 0x3B);  // cmp qword [r11], imm32
+        put32(j, MAX_CALL_DEPTH);
+        fail_unless(j, 0x76, RUNTIME_STACK_OVERFLOW);  // jbe
+        /* check before the frame is allocated, so the failure still runs
+         * within the stack, however large the frame is */
+        PUT(j, 0x48, 0x8D, 0x84, 0x24);  // lea rax, [rsp - frame]
+        put32(j, -frame);
+        mov_imm64(j, R11, (uintptr_t) &j->global[dataCnt + JIT_STACK_LIMIT]);
+        PUT(j, 0x49, 0x3B, 0x03);  // cmp rax, [r11]
+        fail_unless(j, 0x73, RUNTIME_STACK_OVERFLOW);  // jae
+        PUT(j, 0x48, 0x81, 0xEC);  // sub rsp, frame
+        put32(j, frame);
+        for (int i = 0; i < nparams; i++) {
+                if (i < LENGTH(argReg))
+                        store(j, argReg[i], i);
+                else {
+                        PUT(j, 0x48, 0x8B, 0x85);  // mov rax, [rbp + disp]
+                        put32(j, 16 + 8 * (i - LENGTH(argReg)));
+                        store(j, RAX, i);
+                }
+        }
+        if (nregs - nparams <= 8) {
+                for (int i = nparams; i < nregs; i++) {
+                        PUT(j, 0x48, 0xC7, 0x85);  // mov qword [rbp + disp], 0
+                        put32(j, slot(i));
+                        put32(j, 0);
+                }
+        }
+        else {
+                PUT(j, 0x48, 0x8D, 0xBD);  // lea rdi, [rbp + disp]
+                put32(j, slot(nregs - 1));
+                PUT(j, 0xB9);  // mov ecx, count
+                put32(j, nregs - nparams);
+                PUT(j, 0x31, 0xC0);  // xor eax, eax
+                PUT(j, 0xF3, 0x48, 0xAB);  // rep stosq
+        }
+}
+
+static void emit_call(struct Jit *j, const struct InstrInfo *ip)
+{
+        int nargs = procInfo[ip->b].nparams;
+        int nstack = nargs > LENGTH(argReg) ? nargs - LENGTH(argReg) : 0;
+        int pad = nstack & 1;  // keep the stack 16-byte aligned
+
+        if (pad)
+                PUT(j, 0x48, 0x83, 0xEC, 0x08);  // sub rsp, 8
+        for (int i = nargs - 1; i >= LENGTH(argReg); i--) {
+                load(j, RAX, ip->c + i);
+                PUT(j, 0x50);  // push rax
+        }
+        for (int i = 0; i < nargs && i < LENGTH(argReg); i++)
+                load(j, argReg[i], ip->c + i);
+        PUT(j, 0xE8);  // call rel32
+        add_fixup(&j->callFixup, &j->callFixupAlloc, &j->callFixupCnt,
+                  j->codeCnt, ip->b);
+        put32(j, 0);
+        if (nstack + pad) {
+                PUT(j, 0x48, 0x81, 0xC4);  // add rsp, size
+                put32(j, 8 * (nstack + pad));
+        }
+        store(j, RAX, ip->a);
+}
+
+static void emit_instr(struct Jit *j, const struct InstrInfo *ip)
+{
+        switch (ip->op) {
+        case OP_LITERAL:
+                mov_imm64(j, RAX, (unsigned long long) integerLiteral[ip->b]);
+                store(j, RAX, ip->a);
+                break;
+        case OP_IMM:
+                PUT(j, 0x48, 0xC7, 0x85);  // mov qword [rbp + disp], imm32
+                put32(j, slot(ip->a));
+                put32(j, ip->b);
+                break;
+        case OP_MOVE:
+                load(j, RAX, ip->b);
+                store(j, RAX, ip->a);
+                break;
+        case OP_LOADG:
+                mov_imm64(j, RCX, (uintptr_t) &j->global[ip->b]);
+                PUT(j, 0x48, 0x8B, 0x01);  // mov rax, [rcx]
+                store(j, RAX, ip->a);
+                break;
+        case OP_STOREG:
+                load(j, RAX, ip->b);
+                mov_imm64(j, RCX, (uintptr_t) &j->global[ip->a]);
+                PUT(j, 0x48, 0x89, 0x01);  // mov [rcx], rax
+                break;
+        case OP_LOADA:
+                load(j, RAX, ip->c);
+                check_index(j);
+                mov_imm64(j, RCX, (uintptr_t) j->column[ip->b]);
+                PUT(j, 0x48, 0x8B, 0x04, 0xC1);  // mov rax, [rcx + 8*rax]
+                store(j, RAX, ip->a);
+                break;
+        case OP_STOREA:
+                load(j, RAX, ip->b);
+                check_index(j);
+                mov_imm64(j, RCX, (uintptr_t) j->column[ip->a]);
+                PUT(j, 0x48, 0x8D, 0x0C, 0xC1);  // lea rcx, [rcx + 8*rax]
+                load(j, RAX, ip->c);
+                PUT(j, 0x48, 0x89, 0x01);  // mov [rcx], rax
+                break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_AND:
+        case OP_OR:
+        case OP_XOR: {
+                static const unsigned char opcode[NUM_OPS] = {
+                        [OP_ADD] = 0x03, [OP_SUB] = 0x2B, [OP_AND] = 0x23,
+                        [OP_OR] = 0x0B, [OP_XOR] = 0x33,
+                };
+                load(j, RAX, ip->b);
+                op_slot(j, opcode[ip->op], ip->c);
+                store(j, RAX, ip->a);
+                break;
+        }
+        case OP_MUL:
+                load(j, RAX, ip->b);
+                PUT(j, 0x48, 0x0F, 0xAF, 0x85);  // imul rax, [rbp + disp]
+                put32(j, slot(ip->c));
+                store(j, RAX, ip->a);
+                break;
+        case OP_DIV:
+                load(j, RCX, ip->c);
+                PUT(j, 0x48, 0x85, 0xC9);  // test rcx, rcx
+                fail_unless(j, 0x75, RUNTIME_DIVISION_BY_ZERO);  // jnz
+                load(j, RAX, ip->b);
+                /* avoid the overflow trap of LLONG_MIN / -1 */
+                PUT(j, 0x48, 0x83, 0xF9, 0xFF);  // cmp rcx, -1
+                PUT(j, 0x75, 0x05);  // jne +5
+                PUT(j, 0x48, 0xF7, 0xD8);  // neg rax
+                PUT(j, 0xEB, 0x05);  // jmp +5
+                PUT(j, 0x48, 0x99);  // cqo
+                PUT(j, 0x48, 0xF7, 0xF9);  // idiv rcx
+                store(j, RAX, ip->a);
+                break;
+        case OP_EQ:
+                load(j, RAX, ip->b);
+                op_slot(j, 0x3B, ip->c);  // cmp rax, [rbp + disp]
+                PUT(j, 0x0F, 0x94, 0xC0);  // sete al
+                PUT(j, 0x0F, 0xB6, 0xC0);  // movzx eax, al
+                store(j, RAX, ip->a);
+                break;
+        case OP_NEG:
+                load(j, RAX, ip->b);
+                PUT(j, 0x48, 0xF7, 0xD8);  // neg rax
+                store(j, RAX, ip->a);
+                break;
+        case OP_INV:
+                load(j, RAX, ip->b);
+                PUT(j, 0x48, 0xF7, 0xD0);  // not rax
+                store(j, RAX, ip->a);
+                break;
+        case OP_INC:
+                load(j, RAX, ip->b);
+                PUT(j, 0x48, 0x83, 0xC0, 0x01);  // add rax, 1
+                store(j, RAX, ip->a);
+                break;
+        case OP_DEC:
+                load(j, RAX, ip->b);
+                PUT(j, 0x48, 0x83, 0xE8, 0x01);  // sub rax, 1
+                store(j, RAX, ip->a);
+                break;
+        case OP_NOT:
+                load(j, RAX, ip->b);
+                PUT(j, 0x48, 0x85, 0xC0);  // test rax, rax
+                PUT(j, 0x0F, 0x94, 0xC0);  // sete al
+                PUT(j, 0x0F, 0xB6, 0xC0);  // movzx eax, al
+                store(j, RAX, ip->a);
+                break;
+        case OP_JUMP:
+                PUT(j, 0xE9);  // jmp rel32
+                jump_to(j, ip->a);
+                break;
+        case OP_JUMPZ:
+                load(j, RAX, ip->b);
+                PUT(j, 0x48, 0x85, 0xC0);  // test rax, rax
+                PUT(j, 0x0F, 0x84);  // jz rel32
+                jump_to(j, ip->a);
+                break;
+        case OP_CALL:
+                emit_call(j, ip);
+                break;
+        case OP_RETURN:
+                mov_imm64(j, R11,
+                          (uintptr_t) &j->global[dataCnt + JIT_CALL_DEPTH]);
+                PUT(j, 0x49, 0x83, 0x2B, 0x01);  // sub qword [r11], 1
+                load(j, RAX, ip->a);
+                PUT(j, 0xC9);  // leave
+                PUT(j, 0xC3);  // ret
+                break;
+        case OP_TRAP:
+                call_out(j, (void *) bytecode_trap, ip->a, ip->b, 0);
+                break;
+        default:
+                UNHANDLED_CASE();
+        }
+}
+
+static void emit_all_procs(struct Jit *j)
+{
+        BUF_RESERVE(j->instrOffset, j->instrOffsetAlloc, instrCnt);
+        BUF_RESERVE(j->procOffset, j->procOffsetAlloc, procCnt);
+        for (Proc p = 0; p < procCnt; p++) {
+                Instr first = procInfo[p].firstInstr;
+                Instr last = p + 1 < procCnt ?
+                             procInfo[p + 1].firstInstr : instrCnt;
+                j->procOffset[p] = j->codeCnt;
+                emit_prologue(j, p);
+                for (Instr x = first; x < last; x++) {
+                        j->instrOffset[x] = j->codeCnt;
+                        emit_instr(j, &instrInfo[x]);
+                }
+        }
+        for (int i = 0; i < j->jumpFixupCnt; i++)
+                patch(j, j->jumpFixup[i].pos,
+                      j->instrOffset[j->jumpFixup[i].target]);
+        for (int i = 0; i < j->callFixupCnt; i++)
+                patch(j, j->callFixup[i].pos,
+                      j->procOffset[j->callFixup[i].target]);
+}
+
+/* Returns NULL if the address space can't be reserved */
+static void *try_map_zeroed(size_t size)
+{
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        return p == MAP_FAILED ? NULL : p;
+}
+
+static void *map_zeroed(size_t size, const char *what)
+{
+        void *p = try_map_zeroed(size);
+        if (p == NULL)
+                FATAL("Failed to reserve %zu bytes of address space for %s\n",
+                      size, what);
+        return p;
+}
+
+static void *run_native_thread(void *arg)
+{
+        struct JitRun *run = arg;
+        enter_compile_context(&run->ctx);
+        run->result = run->func();
+        return NULL;
+}
+
+/* Like run_proc(), but compiles all procs to native code first */
+long long run_native(Proc proc)
+{
+        struct Jit j;
+        struct JitRun run;
+        size_t columnSize = MAX_ARRAY_LENGTH * sizeof (long long);
+        size_t codeSize;
+        unsigned char *code;
+        char *stack;
+        pthread_attr_t attr;
+        pthread_t thread;
+
+        if (procInfo[proc].nparams != 0)
+                FATAL("Can't run proc %s: it takes arguments\n",
+                      SS(procInfo[proc].sym));
+
+        CLEAR(j);
+        /* one mapping for all columns, so the number of mappings doesn't
+         * grow with the number of arrays */
+        j.columnsSize = (size_t) arrayCnt * columnSize + 1;
+        j.columns = try_map_zeroed(j.columnsSize);
+        if (j.columns == NULL) {
+                WARN("Not enough address space for the columns of %d arrays, "
+                     "interpreting bytecode instead\n", arrayCnt);
+                return run_proc(proc);
+        }
+        j.globalSize = (dataCnt + NUM_JIT_SLOTS) * sizeof (long long);
+        j.global = map_zeroed(j.globalSize, "the global data");
+        BUF_INIT(j.column, j.columnAlloc);
+        BUF_RESERVE(j.column, j.columnAlloc, arrayCnt);
+        for (Array i = 0; i < arrayCnt; i++)
+                j.column[i] = (long long *) (j.columns + i * columnSize);
+        stack = map_zeroed(JIT_STACK_SIZE, "the stack");
+        j.global[dataCnt + JIT_STACK_LIMIT] =
+                (long long) (uintptr_t) (stack + JIT_STACK_RESERVE);
+
+        BUF_INIT(j.code, j.codeAlloc);
+        BUF_INIT(j.jumpFixup, j.jumpFixupAlloc);
+        BUF_INIT(j.callFixup, j.callFixupAlloc);
+        BUF_INIT(j.instrOffset, j.instrOffsetAlloc);
+        BUF_INIT(j.procOffset, j.procOffsetAlloc);
+        emit_all_procs(&j);
+
+        /* never writable and executable at the same time */
+        codeSize = (size_t) j.codeCnt + 1;
+        code = map_zeroed(codeSize, "the native code");
+        mem_copy(code, j.code, j.codeCnt);
+        if (mprotect(code, codeSize, PROT_READ | PROT_EXEC) != 0)
+                FATAL("Failed to make the native code executable\n");
+
+        leave_compile_context(&run.ctx);
+        run.func = (long long (*)(void)) (void *) (code + j.procOffset[proc]);
+        if (pthread_attr_init(&attr) != 0 ||
+            pthread_attr_setstack(&attr, stack, JIT_STACK_SIZE) != 0 ||
+            pthread_create(&thread, &attr, run_native_thread, &run) != 0)
+                FATAL("Failed to start a thread for the native code\n");
+        pthread_join(thread, NULL);
+        pthread_attr_destroy(&attr);
+
+        munmap(code, codeSize);
+        munmap(stack, JIT_STACK_SIZE);
+        munmap(j.columns, j.columnsSize);
+        BUF_EXIT(j.column, j.columnAlloc);
+        munmap(j.global, j.globalSize);
+        BUF_EXIT(j.code, j.codeAlloc);
+        BUF_EXIT(j.jumpFixup, j.jumpFixupAlloc);
+        BUF_EXIT(j.callFixup, j.callFixupAlloc);
+        BUF_EXIT(j.instrOffset, j.instrOffsetAlloc);
+        BUF_EXIT(j.procOffset, j.procOffsetAlloc);
+        return run.result;
+}
+#else
+long long run_native(Proc proc)
+{
+        WARN("No native code generation on this platform, "
+             "interpreting bytecode instead\n");
+        return run_proc(proc);
+}
+#endif
@@ -1,7 +1,29 @@
 #include "defs.h"
 #include "api.h"
 
-static int indentSize;
+static THREAD_LOCAL int indentSize;
+static THREAD_LOCAL struct OutputBuffer *out;
+
+void init_output_buffer(struct OutputBuffer *ob)
+{
+        BUF_INIT(ob->buf, ob->bufAlloc);
+        ob->bufCnt = 0;
+}
+
+void exit_output_buffer(struct OutputBuffer *ob)
+{
+        BUF_EXIT(ob->buf, ob->bufAlloc);
+}
+
+/* Returns space for len more bytes at the end of the output buffer */
+static inline char *pprint_space(int len)
+{
+        char *p;
+        BUF_RESERVE(out->buf, out->bufAlloc, out->bufCnt + len);
+        p = out->buf + out->bufCnt;
+        out->bufCnt += len;
+        return p;
+}
 
 void add_indent(void)
 {
@@ -15,15 +37,32 @@ void remove_indent(void)
 
 void pprint(const char *buf)
 {
-        output("%s", buf);
+        int len = cstr_length(buf);
+        mem_copy(pprint_space(len), buf, len);
+}
+
+void pprint_int(long long x)
+{
+        char tmp[24];
+        int n = 0;
+        /* negate as unsigned, which works for the smallest value, too */
+        unsigned long long u = x < 0 ? 0 - (unsigned long long) x :
+                                       (unsigned long long) x;
+
+        do {
+                tmp[sizeof tmp - ++n] = (char) ('0' + u % 10);
+                u /= 10;
+        } while (u);
+        if (x < 0)
+                tmp[sizeof tmp - ++n] = '-';
+        mem_copy(pprint_space(n), tmp + sizeof tmp - n, n);
 }
-#define pprintf output
 
 void pprint_newline(void)
 {
-        pprint("\n");
-        for (int i = 0; i < indentSize; i++)
-                pprint(" ");
+        char *p = pprint_space(1 + indentSize);
+        p[0] = '\n';
+        mem_fill(p + 1, ' ', indentSize);
 }
 
 void pprint_type(Type tp)
@@ -97,11 +136,12 @@ void pprint_expr(Expr expr)
                 }
                 case EXPR_LITERAL: {
                         Token tok = exprInfo[expr].tLiteral.tok;
-                        pprintf("%lld", tokenInfo[tok].tInteger);
+                        int lit = tokenValue[tok].literal;
+                        pprint_int(integerLiteral[lit]);
                         break;
                 }
                 case EXPR_UNOP: {
-                        int unop = exprInfo[expr].tUnop.kind;
+                        int unop = exprInfo[expr].opkind;
                         int isprefix = unopInfo[unop].isprefix;
                         const char *str = unopInfo[unop].str;
                         if (isprefix)
@@ -113,7 +153,7 @@ void pprint_expr(Expr expr)
                 }
                 case EXPR_BINOP: {
                         pprint_expr(exprInfo[expr].tBinop.expr1);
-                        int binop = exprInfo[expr].tBinop.kind;
+                        int binop = exprInfo[expr].opkind;
                         pprint(" ");
                         pprint(binopInfo[binop].str);
                         pprint(" ");
@@ -274,8 +314,28 @@ void pprint_proc(Proc p)
         pprint("\n");
 }
 
-void prettyprint(void)
+#define PPRINT_CHUNK 64  // procs per chunk
+
+static void pprint_procs_worker(void *arg, int first, int last)
+{
+        struct OutputBuffer *chunks = arg;
+        out = &chunks[first / PPRINT_CHUNK];
+        for (Proc i = first; i < last; i++)
+                pprint_proc(i);
+        out = NULL;
+}
+
+/* Appends the program to ob. The procs are rendered in parallel if
+ * numThreads > 1, each chunk of procs into a buffer of its own. The buffers
+ * are appended in order, so the result doesn't depend on the number of
+ * threads. */
+void prettyprint_to_buffer(struct OutputBuffer *ob)
 {
+        struct OutputBuffer *chunks;
+        struct Alloc chunksAlloc;
+        int nchunks = (procCnt + PPRINT_CHUNK - 1) / PPRINT_CHUNK;
+
+        out = ob;
         for (Type i = 0; i < typeCnt; i++)
                 if (typeInfo[i].kind == TYPE_ENTITY)
                         pprint_entity(i);
@@ -288,7 +348,32 @@ void prettyprint(void)
                 if (scopeInfo[arrayInfo[i].scope].kind == globalScope)
                         pprint_array(i);
         pprint_newline();
-        for (Proc i = 0; i < procCnt; i++)
-                pprint_proc(i);
+
+        BUF_INIT(chunks, chunksAlloc);
+        BUF_RESERVE(chunks, chunksAlloc, nchunks);
+        for (int i = 0; i < nchunks; i++)
+                init_output_buffer(&chunks[i]);
+        parallel_for(numThreads, procCnt, PPRINT_CHUNK,
+                     pprint_procs_worker, chunks);
+        out = ob;
+        for (int i = 0; i < nchunks; i++) {
+                int len = chunks[i].bufCnt;
+                mem_copy(pprint_space(len), chunks[i].buf, len);
+                exit_output_buffer(&chunks[i]);
+        }
+        BUF_EXIT(chunks, chunksAlloc);
+
         pprint_newline();
+        out = NULL;
+}
+
+/* Prints the program to stdout, with a single write */
+void prettyprint(void)
+{
+        struct OutputBuffer ob;
+
+        init_output_buffer(&ob);
+        prettyprint_to_buffer(&ob);
+        output_bytes(ob.buf, ob.bufCnt);
+        exit_output_buffer(&ob);
 }
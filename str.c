@@ -1,5 +1,6 @@
 #include "defs.h"
 #include "api.h"
+#include <string.h>
 
 String add_string(const char *buf, int len)
 {
@@ -19,73 +20,223 @@ String add_string(const char *buf, int len)
         return s;
 }
 
+static inline unsigned long long hash_mix(unsigned long long h,
+                                          unsigned long long w)
+{
+        h = (h ^ w) * 0x9E3779B97F4A7C15ull;
+        return h ^ (h >> 29);
+}
+
+/* Hashes 8 bytes at a time. Words are loaded with fixed-size memcpy(), which
+ * compiles to single unaligned loads. A tail of 4 to 7 bytes is read as two
+ * overlapping 4-byte words (like wyhash does), so no byte loop is needed. */
 unsigned hash_string(const void *str, int len)
 {
-        unsigned hsh = 5381;
-        for (int i = 0; i < len; i++)
-                hsh = 33*hsh + ((const unsigned char *)str)[i];
-        return hsh;
+        const unsigned char *p = str;
+        unsigned long long h = 0xA0761D6478BD642Full ^ (unsigned) len;
+        unsigned long long w;
+        unsigned lo;
+        unsigned hi;
+
+        for (; len >= 8; p += 8, len -= 8) {
+                memcpy(&w, p, 8);
+                h = hash_mix(h, w);
+        }
+        if (len >= 4) {
+                memcpy(&lo, p, 4);
+                memcpy(&hi, p + len - 4, 4);
+                h = hash_mix(h, (unsigned long long) hi << 32 | lo);
+        }
+        else if (len > 0) {
+                w = (unsigned long long) p[0] << 16 |
+                    (unsigned long long) p[len >> 1] << 8 | p[len - 1];
+                h = hash_mix(h, w);
+        }
+        h *= 0xE7037ED1A0B428DBull;
+        return (unsigned) (h ^ (h >> 32));
 }
 
-String lookup_string_with_hash(const void *buf, int len, unsigned hsh)
+/* The functions below work on any bucket array: the global string table's
+ * as well as those of the thread-private string arenas. */
+
+/* Returns the slot that holds the string, or the empty slot where it should be
+ * inserted. The table must have at least one empty slot. chars is the
+ * character buffer that the slots' pos fields refer to. */
+static int find_string_bucket(const struct StringBucketInfo *buckets,
+                              int bucketCnt, const char *chars,
+                              const void *buf, int len, unsigned hsh)
 {
+        unsigned mask = bucketCnt - 1;
         unsigned bck;
-        String s;
 
-        bck = hsh & (strBucketCnt - 1);
-        for (s = strBucketInfo[bck].firstString; s != -1;
-             s = stringInfo[s].next) {
-                if (string_length(s) == len &&
-                    mem_compare(string_buffer(s), buf, len) == 0)
-                        return s;
+        for (bck = hsh & mask;; bck = (bck + 1) & mask) {
+                const struct StringBucketInfo *b = &buckets[bck];
+                if (b->string == -1)
+                        return bck;
+                if (b->hash == hsh && b->length == len &&
+                    mem_compare(&chars[b->pos], buf, len) == 0)
+                        return bck;
         }
-        return -1;
 }
 
-void insert_string_with_hash(String s, unsigned hsh)
+/* Moves all entries to a new table with nbuckets slots. Entries are placed
+ * using their stored hashes. Because all strings are distinct, there is no
+ * need to compare them, and the character data is not touched at all. */
+static void resize_string_buckets(struct StringBucketInfo **buckets,
+                                  struct Alloc *alloc, int *bucketCnt,
+                                  int nbuckets)
 {
+        struct StringBucketInfo *old = *buckets;
+        struct StringBucketInfo *newBuckets;
+        struct Alloc oldAlloc = *alloc;
+        struct Alloc newAlloc;
+        int oldCnt = *bucketCnt;
+        unsigned mask = nbuckets - 1;
         unsigned bck;
-       
-        bck = hsh & (strBucketCnt - 1);
-        stringInfo[s].next = strBucketInfo[bck].firstString;
-        strBucketInfo[bck].firstString = s;
+
+        // MUST BE POWER OF 2 !!!!
+        assert((nbuckets & (nbuckets-1)) == 0);
+
+        BUF_INIT(newBuckets, newAlloc);
+        BUF_RESERVE(newBuckets, newAlloc, nbuckets);
+        for (int i = 0; i < nbuckets; i++)
+                newBuckets[i].string = -1;
+        for (int i = 0; i < oldCnt; i++) {
+                if (old[i].string == -1)
+                        continue;
+                for (bck = old[i].hash & mask;
+                     newBuckets[bck].string != -1;
+                     bck = (bck + 1) & mask)
+                        ;
+                newBuckets[bck] = old[i];
+        }
+        BUF_EXIT(old, oldAlloc);
+        *buckets = newBuckets;
+        *alloc = newAlloc;
+        *bucketCnt = nbuckets;
+}
+
+/* Size for a bucket array holding nstrings, with load factor below 66%. That
+ * is between 1.5 and 3 buckets (of 16 bytes each) per string. */
+static int string_bucket_count(int bucketCnt, int nstrings)
+{
+        int n = bucketCnt ? bucketCnt : 256;
+        while (2 * n <= 3 * nstrings)
+                n *= 2;
+        return n;
+}
+
+void reserve_strings(int nstrings)
+{
+        int n = string_bucket_count(strBucketCnt, nstrings);
+        if (n > strBucketCnt)
+                resize_string_buckets(&strBucketInfo, &strBucketInfoAlloc,
+                                      &strBucketCnt, n);
+}
+
+static String intern_string_with_hash(const void *buf, int len, unsigned hsh)
+{
+        int bck;
+        String s;
+
+        if (2 * strBucketCnt <= 3 * stringCnt)
+                reserve_strings(stringCnt);
+
+        bck = find_string_bucket(strBucketInfo, strBucketCnt, strbuf,
+                                 buf, len, hsh);
+        s = strBucketInfo[bck].string;
+        if (s == -1) {
+                s = add_string(buf, len);
+                strBucketInfo[bck].hash = hsh;
+                strBucketInfo[bck].length = len;
+                strBucketInfo[bck].pos = stringInfo[s].pos;
+                strBucketInfo[bck].string = s;
+        }
+        return s;
 }
 
 String intern_string(const void *buf, int len)
 {
-        int i;
+        return intern_string_with_hash(buf, len, hash_string(buf, len));
+}
+
+String intern_cstring(const char *str)
+{
+        return intern_string((const void *)str, cstr_length(str));
+}
+
+/* The arena's table is sized for nstrings up front, so interning that many
+ * strings never resizes it */
+void init_string_arena(struct StringArena *arena, int nstrings)
+{
+        BUF_INIT(arena->strbuf, arena->strbufAlloc);
+        BUF_INIT(arena->strings, arena->stringsAlloc);
+        BUF_INIT(arena->bucketInfo, arena->bucketInfoAlloc);
+        arena->strbufCnt = 0;
+        arena->stringCnt = 0;
+        arena->bucketCnt = 0;
+        resize_string_buckets(&arena->bucketInfo, &arena->bucketInfoAlloc,
+                              &arena->bucketCnt,
+                              string_bucket_count(0, nstrings));
+}
+
+void exit_string_arena(struct StringArena *arena)
+{
+        BUF_EXIT(arena->strbuf, arena->strbufAlloc);
+        BUF_EXIT(arena->strings, arena->stringsAlloc);
+        BUF_EXIT(arena->bucketInfo, arena->bucketInfoAlloc);
+}
+
+String arena_intern_string(struct StringArena *arena,
+                           const void *buf, int len)
+{
         unsigned hsh;
+        int bck;
+        int pos;
         String s;
 
-        /* resize hash map if load factor exceeds 66% */
-        if (2 * strBucketCnt <= 3 * stringCnt) {
-                if (strBucketCnt == 0)
-                        strBucketCnt = 256;
-                while (2 * strBucketCnt < 3 * stringCnt)
-                        strBucketCnt *= 2;
-
-                BUF_RESERVE(strBucketInfo, strBucketInfoAlloc, strBucketCnt);
-                for (i = 0; i < strBucketCnt; i++)
-                        strBucketInfo[i].firstString = -1;
-
-                for (s = 0; s < stringCnt; s++) {
-                        hsh = hash_string(string_buffer(s), string_length(s));
-                        insert_string_with_hash(s, hsh);
-                }
+        if (2 * arena->bucketCnt <= 3 * arena->stringCnt) {
+                int n = string_bucket_count(arena->bucketCnt,
+                                            arena->stringCnt);
+                resize_string_buckets(&arena->bucketInfo,
+                                      &arena->bucketInfoAlloc,
+                                      &arena->bucketCnt, n);
         }
-        // MUST BE POWER OF 2 !!!!
-        assert((strBucketCnt & (strBucketCnt-1)) == 0);
 
         hsh = hash_string(buf, len);
-        s = lookup_string_with_hash(buf, len, hsh);
+        bck = find_string_bucket(arena->bucketInfo, arena->bucketCnt,
+                                 arena->strbuf, buf, len, hsh);
+        s = arena->bucketInfo[bck].string;
         if (s == -1) {
-                s = add_string(buf, len);
-                insert_string_with_hash(s, hsh);
+                pos = arena->strbufCnt;
+                arena->strbufCnt += len;
+                BUF_RESERVE(arena->strbuf, arena->strbufAlloc,
+                            arena->strbufCnt);
+                mem_copy(&arena->strbuf[pos], buf, len);
+
+                s = arena->stringCnt++;
+                BUF_RESERVE(arena->strings, arena->stringsAlloc,
+                            arena->stringCnt);
+                arena->strings[s].hash = hsh;
+                arena->strings[s].length = len;
+                arena->strings[s].pos = pos;
+                arena->strings[s].string = s;
+                arena->bucketInfo[bck] = arena->strings[s];
         }
         return s;
 }
 
-String intern_cstring(const char *str)
+void merge_string_arena(struct StringArena *arena, String *map)
 {
-        return intern_string((const void *)str, cstr_length(str));
+        /* Strings are merged in the order in which they were first added to
+         * the arena. Merging the arenas of several files in file order thus
+         * numbers the global Strings exactly like interning the files' words
+         * one after another on a single thread. The stored hashes are reused,
+         * so every string is hashed only once. */
+        reserve_strings(stringCnt + arena->stringCnt);
+        for (String s = 0; s < arena->stringCnt; s++) {
+                const struct StringBucketInfo *x = &arena->strings[s];
+                map[s] = intern_string_with_hash(&arena->strbuf[x->pos],
+                                                 x->length, x->hash);
+        }
 }